@@ -0,0 +1,129 @@
+/*
+ * hal_m328p.h
+ *
+ *  Hardware abstraction for the ATmega328P target.
+ *  This file is included by ps2spi.c when building for the ATmega328P,
+ *  and defines the PS2 pin access, the hardware SPI slave backend, the timers
+ *  and the SRAM arena size for this part.
+ *
+ *  | Function  | AVR  | Pin | I/O               |
+ *  |-----------|------|-----|-------------------|
+ *  | Reset     | PC6  | 1   | RPi GPIO22        |
+ *  | PS2 clock | PD2  | 4   | in/out w/ pull up |
+ *  | PS2 data  | PD3  | 5   | in/out w/ pull up |
+ *  | SS        | PB2  | 16  | RPi CE0           |
+ *  | MOSI      | PB3  | 17  | RPi MOSI          |
+ *  | MISO      | PB4  | 18  | RPi MISO          |
+ *  | SCK       | PB5  | 19  | RPi SCL           |
+ *
+ *  Pin numbers are for the 28 pin DIP package.
+ *  SS frames each transaction: the SPI bit counter is held in reset while
+ *  SS is high, and SPI_SS_vect ends a burst read the host did not finish.
+ *  Like the USI, the SPI only buffers the received byte, so the response
+ *  byte is still written in SPI_XFER_vect and the host keeps the inter-byte gap.
+ *
+ */
+
+#ifndef __HAL_M328P_H__
+#define __HAL_M328P_H__
+
+// IO port B initialization
+#define     PB_DDR_INIT     0b00010000  // Port data direction, MISO output
+#define     PB_PUP_INIT     0b00000100  // Port input pin pull-up, SS inactive when not connected
+#define     PB_INIT         0b00000000  // Port initial values
+
+// IO port D initialization
+#define     PD_DDR_INIT     0b00000000  // Port data direction
+#define     PD_INIT         0b00000000  // Port initial values
+
+// PS2 control lines
+#define     PS2_PORT        PORTD
+#define     PS2_DDR         DDRD
+#define     PS2_PIN         PIND
+#define     PS2_CLOCK       0b00000100  // PD2
+#define     PS2_DATA        0b00001000  // PD3
+
+// Pin change interrupt setting
+#define     PCICR_INIT      0b00000101  // Enable pin change sensing on PB and PD
+#define     PCMSK0_INIT     0b00000100  // Enable pin change interrupt on PB2 (SS)
+#define     PCMSK2_INIT     0b00000100  // Enable pin change interrupt on PD2 (PS2 clock)
+#define     PS2_CLOCK_vect  PCINT2_vect // PS2 clock pin change interrupt
+#define     SPI_SS_vect     PCINT0_vect // SPI slave select pin change interrupt
+#define     SPI_SS          0b00000100  // PB2
+
+// Timer0 system tick, CTC mode with 1mSec period, OCR0A is 124 at 8MHz and 249 at 16MHz
+#define     TCCR0A_INIT     0b00000010  // CTC mode
+#define     TCCR0B_INIT     0b00000011  // Clock/64 prescaler
+#define     OCR0A_INIT      ((F_CPU / 64000UL) - 1) // F_CPU / 64 / (OCR0A_INIT + 1) = 1kHz
+#define     TIMSK0_INIT     0b00000010  // Output compare match A interrupt enable
+
+// Timer2 free running at system clock to count ISR cycles
+#define     TCCR2B_INIT     0b00000001
+#define     HAL_CYCLES      TCNT2
+#define     TIMSK2_OCIE2A   0b00000010  // Compare match A interrupt enable, wake-up latency probe
+#define     TIFR2_OCF2A     0b00000010  // Compare match A flag, cleared by writing 1
+#define     WAKE_PROBE_vect TIMER2_COMPA_vect
+#define     HAL_WAKE_MATCH  OCR2A
+
+// SPI
+#define     SPCR_INIT       0b11000000  // Interrupt and SPI enabled, slave, MSB first, mode 0
+
+#define     SPI_DATA        SPDR        // Byte received, and byte to send on the next transfer
+#define     SPI_XFER_vect   SPI_STC_vect
+
+// SRAM arena, 2048 bytes of SRAM
+#define     ARENA_SIZE      1024        // Bytes available to the arena
+#define     PS2_BUFF_SIZE   32          // PS2 input buffer
+#define     KEY_BUFF_SIZE   128         // Key code output buffer
+#ifndef TRACE_BUFF_SIZE
+#define     TRACE_BUFF_SIZE 128         // Raw PS2 trace entries
+#endif
+
+/* IO pins, SPI slave, and the PS2 clock and SS pin change interrupts
+ */
+#define     HAL_IO_INIT() \
+    { \
+        DDRB  = PB_DDR_INIT; \
+        PORTB = PB_INIT; \
+        PORTB = PB_INIT | PB_PUP_INIT; \
+        DDRD  = PD_DDR_INIT; \
+        PORTD = PD_INIT; \
+        SPDR = 0; \
+        SPCR = SPCR_INIT; \
+        PCMSK0 = PCMSK0_INIT; \
+        PCMSK2 = PCMSK2_INIT; \
+        PCICR = PCICR_INIT; \
+    }
+
+#define     HAL_TICK_INIT() \
+    { \
+        TCCR0A = TCCR0A_INIT; \
+        TCCR0B = TCCR0B_INIT; \
+        OCR0A = OCR0A_INIT; \
+        TIMSK0 = TIMSK0_INIT; \
+    }
+
+#define     HAL_CYCLES_INIT()   { TCCR2B = TCCR2B_INIT; }
+
+// Stop and restart the Timer0 tick interrupt, for an idle sleep with nothing waiting on the tick
+#define     HAL_TICK_STOP()     { TIMSK0 &= ~TIMSK0_INIT; }
+#define     HAL_TICK_START()    { TIMSK0 |= TIMSK0_INIT; }
+
+// Arm a one shot compare match 'lead' cycles ahead, clearing a stale match flag first
+#define     HAL_WAKE_ARM(lead) \
+    { \
+        OCR2A = HAL_CYCLES + (lead); \
+        TIFR2 = TIFR2_OCF2A; \
+        TIMSK2 |= TIMSK2_OCIE2A; \
+    }
+#define     HAL_WAKE_DISARM()   { TIMSK2 &= ~TIMSK2_OCIE2A; }
+
+/* No transfer is in progress while SS is high, SPI_DATA can then be
+ * replaced without a write collision
+ */
+#define     HAL_SPI_IDLE()      ((PINB & SPI_SS) != 0)
+
+// The SPI needs no re-arming, SPIF is cleared by entering SPI_XFER_vect
+#define     HAL_SPI_NEXT()      { }
+
+#endif  /* __HAL_M328P_H__ */
@@ -0,0 +1,125 @@
+/*
+ * hal_tiny85.h
+ *
+ *  Hardware abstraction for the ATtiny85 target.
+ *  This file is included by ps2spi.c when building for the ATtiny85,
+ *  and defines the PS2 pin access, the USI SPI slave backend, the timers
+ *  and the SRAM arena size for this part.
+ *
+ *  | Function  | AVR  | Pin | I/O               |
+ *  |-----------|------|-----|-------------------|
+ *  | Reset     | PB5  | 1   | RPi GPIO22        |
+ *  | PS2 clock | PB3  | 2   | in/out w/ pull up |
+ *  | PS2 data  | PB4  | 3   | in/out w/ pull up |
+ *  | DI        | PB0  | 5   | RPi MOSI          |
+ *  | DO        | PB1  | 6   | RPi MISO          |
+ *  | SCLK      | PB2  | 7   | RPi SCL           |
+ *
+ *  The USI has no slave select, so the host keeps byte alignment by
+ *  always clocking whole bytes.
+ *
+ */
+
+#ifndef __HAL_TINY85_H__
+#define __HAL_TINY85_H__
+
+// IO port B initialization
+#define     PB_DDR_INIT     0b00000010  // Port data direction
+#define     PB_PUP_INIT     0b00000000  // Port input pin pull-up
+#define     PB_INIT         0b00000000  // Port initial values
+
+// PS2 control lines
+#define     PS2_PORT        PORTB
+#define     PS2_DDR         DDRB
+#define     PS2_PIN         PINB
+#define     PS2_CLOCK       0b00001000  // PB3
+#define     PS2_DATA        0b00010000  // PB4
+
+// Pin change interrupt setting
+#define     GIMSK_INIT      0x20        // Enable pin change sensing on PB
+#define     PCMSK_INIT      0b00001000  // Enable pin change interrupt on PB3
+#define     PS2_CLOCK_vect  PCINT0_vect // PS2 clock pin change interrupt
+
+// Timer0 system tick, CTC mode with 1mSec period, OCR0A is 124 at 8MHz and 249 at 16MHz
+#define     TCCR0A_INIT     0b00000010  // CTC mode
+#define     TCCR0B_INIT     0b00000011  // Clock/64 prescaler
+#define     OCR0A_INIT      ((F_CPU / 64000UL) - 1) // F_CPU / 64 / (OCR0A_INIT + 1) = 1kHz
+#define     TIMSK_INIT      0b00010000  // Output compare match A interrupt enable
+
+// Timer1 free running at system clock to count ISR cycles
+#define     TCCR1_INIT      0b00000001
+#define     HAL_CYCLES      TCNT1
+#define     TIMSK_OCIE1A    0b01000000  // Compare match A interrupt enable, wake-up latency probe
+#define     TIFR_OCF1A      0b01000000  // Compare match A flag, cleared by writing 1
+#define     WAKE_PROBE_vect TIMER1_COMPA_vect
+#define     HAL_WAKE_MATCH  OCR1A
+
+// USI
+#define     USICR_INIT      0b01011000  // 3-wire, external clock, positive edge, interrupts enabled
+#define     USICR_USIOIE    0b01000000  // Counter Overflow Interrupt Enable
+
+#define     USI_CNTR_OVRF   0b01000000  // Counter overflow
+#define     USI_COUNTER     0b00001111  // USI mask counter bits
+
+#define     SPI_DATA        USIDR       // Byte received, and byte to send on the next transfer
+#define     SPI_XFER_vect   USI_OVF_vect
+
+// SRAM arena, 512 bytes of SRAM
+#define     ARENA_SIZE      256         // Bytes available to the arena
+#define     PS2_BUFF_SIZE   8           // PS2 input buffer
+#define     KEY_BUFF_SIZE   64          // Key code output buffer
+#ifndef TRACE_BUFF_SIZE
+#define     TRACE_BUFF_SIZE 16          // Raw PS2 trace entries
+#endif
+
+/* IO pins, USI in 3-wire mode (SPI) and the PS2 clock pin change interrupt
+ */
+#define     HAL_IO_INIT() \
+    { \
+        DDRB  = PB_DDR_INIT; \
+        PORTB = PB_INIT; \
+        PORTB = PB_INIT | PB_PUP_INIT; \
+        USISR &= ~USI_COUNTER; \
+        USISR |= USI_CNTR_OVRF; \
+        USIDR = 0; \
+        USICR = USICR_INIT; \
+        GIMSK = GIMSK_INIT; \
+        PCMSK = PCMSK_INIT; \
+    }
+
+#define     HAL_TICK_INIT() \
+    { \
+        TCCR0A = TCCR0A_INIT; \
+        TCCR0B = TCCR0B_INIT; \
+        OCR0A = OCR0A_INIT; \
+        TIMSK = TIMSK_INIT; \
+    }
+
+#define     HAL_CYCLES_INIT()   { TCCR1 = TCCR1_INIT; }
+
+// Stop and restart the Timer0 tick interrupt, for an idle sleep with nothing waiting on the tick
+#define     HAL_TICK_STOP()     { TIMSK &= ~TIMSK_INIT; }
+#define     HAL_TICK_START()    { TIMSK |= TIMSK_INIT; }
+
+// Arm a one shot compare match 'lead' cycles ahead, clearing a stale match flag first
+#define     HAL_WAKE_ARM(lead) \
+    { \
+        OCR1A = HAL_CYCLES + (lead); \
+        TIFR = TIFR_OCF1A; \
+        TIMSK |= TIMSK_OCIE1A; \
+    }
+#define     HAL_WAKE_DISARM()   { TIMSK &= ~TIMSK_OCIE1A; }
+
+/* The USI counter is 0 between bytes, SPI_DATA can then be
+ * replaced without corrupting a transfer
+ */
+#define     HAL_SPI_IDLE()      ((USISR & USI_COUNTER) == 0)
+
+// Re-arm the USI counter for the next byte, at the end of SPI_XFER_vect
+#define     HAL_SPI_NEXT() \
+    { \
+        USISR &= ~USI_COUNTER; \
+        USISR |= USI_CNTR_OVRF; \
+    }
+
+#endif  /* __HAL_TINY85_H__ */
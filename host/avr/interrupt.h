@@ -0,0 +1,17 @@
+/*
+ * avr/interrupt.h
+ *
+ *  Host stub: an ISR is a plain function the harness calls for each interrupt,
+ *  and interrupts never preempt the code that runs between those calls.
+ *
+ */
+
+#ifndef __HOST_AVR_INTERRUPT_H__
+#define __HOST_AVR_INTERRUPT_H__
+
+#define     ISR(vector)     void vector(void)
+
+#define     sei()
+#define     cli()
+
+#endif  /* __HOST_AVR_INTERRUPT_H__ */
@@ -0,0 +1,40 @@
+/*
+ * avr/io.h
+ *
+ *  Host stub of the avr-libc IO register header for the ps2spi replay harness.
+ *  Each register used by ps2spi.c and its HAL headers is a plain variable,
+ *  read and written by the harness to drive the PS2 and SPI lines.
+ *  The harness builds ps2spi.c as part of a single translation unit,
+ *  so the registers are defined here.
+ *
+ */
+
+#ifndef __HOST_AVR_IO_H__
+#define __HOST_AVR_IO_H__
+
+#include    <stdint.h>
+
+// Ports
+volatile uint8_t PINB, PORTB, DDRB;
+volatile uint8_t PIND, PORTD, DDRD;
+
+// General purpose IO registers
+volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+
+// System control
+volatile uint8_t CLKPR, MCUSR;
+
+// Pin change interrupts, ATtiny85 and ATmega328P
+volatile uint8_t GIMSK, PCMSK;
+volatile uint8_t PCICR, PCMSK0, PCMSK2;
+
+// Timers, ATtiny85 and ATmega328P
+volatile uint8_t TCCR0A, TCCR0B, OCR0A, TIMSK, TIMSK0, TIFR;
+volatile uint8_t TCCR1, TCNT1, OCR1A;
+volatile uint8_t TCCR2B, TCNT2, OCR2A, TIMSK2, TIFR2;
+
+// USI and SPI
+volatile uint8_t USICR, USIDR, USISR;
+volatile uint8_t SPCR, SPDR;
+
+#endif  /* __HOST_AVR_IO_H__ */
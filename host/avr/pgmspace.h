@@ -0,0 +1,16 @@
+/*
+ * avr/pgmspace.h
+ *
+ *  Host stub: flash tables are ordinary constant data.
+ *
+ */
+
+#ifndef __HOST_AVR_PGMSPACE_H__
+#define __HOST_AVR_PGMSPACE_H__
+
+#include    <stdint.h>
+
+#define     PROGMEM
+#define     pgm_read_byte(address)  (*(const uint8_t *)(address))
+
+#endif  /* __HOST_AVR_PGMSPACE_H__ */
@@ -0,0 +1,18 @@
+/*
+ * avr/sleep.h
+ *
+ *  Host stub: idle sleep is not modeled.
+ *
+ */
+
+#ifndef __HOST_AVR_SLEEP_H__
+#define __HOST_AVR_SLEEP_H__
+
+#define     SLEEP_MODE_IDLE     0
+
+#define     set_sleep_mode(mode)
+#define     sleep_enable()
+#define     sleep_disable()
+#define     sleep_cpu()
+
+#endif  /* __HOST_AVR_SLEEP_H__ */
@@ -0,0 +1,17 @@
+/*
+ * avr/wdt.h
+ *
+ *  Host stub: the watchdog is not modeled.
+ *
+ */
+
+#ifndef __HOST_AVR_WDT_H__
+#define __HOST_AVR_WDT_H__
+
+#define     WDTO_60MS       2
+
+#define     wdt_enable(timeout)
+#define     wdt_reset()
+#define     wdt_disable()
+
+#endif  /* __HOST_AVR_WDT_H__ */
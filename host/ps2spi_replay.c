@@ -0,0 +1,1191 @@
+/*
+ * ps2spi_replay.c
+ *
+ *  Host-native replay harness and benchmark for the ps2spi firmware logic.
+ *
+ *  ps2spi.c is built for the host against the stub AVR headers in this directory,
+ *  and its ISRs are called as plain functions from a discrete event simulation:
+ *  a keyboard model clocks PS2 frames into PS2_CLOCK_vect, Timer0 ticks every 1mSec,
+ *  a host model reads the AVR through SPI_XFER_vect on a poll schedule, and the
+ *  main loop is a kbd_process() pass at a fixed period. ISRs never preempt
+ *  kbd_process(), their logic runs at the time of their request.
+ *  ISR timing is checked separately against estimated worst case cycles of each ISR.
+ *  ISRs do not nest, so one requested while another runs is delayed, and a PS2 clock
+ *  ISR delayed past the next clock edge or an SPI ISR that has not re-armed the counter
+ *  when the host starts the next byte is counted as late.
+ *  After a pass that finds kbd_idle() and kbd_tick_idle(), Timer0 ticks are skipped
+ *  as on the AVR with TICK_GATE, until the next PS2 clock edge or SPI byte.
+ *
+ *  The PS2 workload is either a built-in typing generator or a trace captured
+ *  on the device with the Trace command, a file of 3 byte type/data/tick entries.
+ *  Received bytes and receive errors of the trace are replayed as PS2 frames at their
+ *  tick, and the keyboard replies come from the trace. The built-in keyboard model
+ *  answers keyboard commands itself.
+ *
+ *  At the end the harness reports dropped codes, the FIFO high-water marks and
+ *  latencies from the firmware statistics, and the host CPU cost of the receive and
+ *  translation path. It exits with 1 when codes were dropped or an ISR was late, so a
+ *  workload can be regression checked, '-o' writes the key codes read for comparison
+ *  with a reference, and '-q' leaves out the host CPU figure so the whole report is
+ *  reproducible. 'make -C host check' replays a set of workloads that way.
+ *
+ *  usage: ps2spi_replay [-f trace] [-n keys] [-k keys_per_sec] [-m poll|burst|drdy]
+ *                       [-p poll_us] [-s sclk_hz] [-g gap_us] [-l loop_us]
+ *                       [-x mode] [-o codes_file] [-q]
+ *
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <time.h>
+#include    <unistd.h>
+
+#define     main            fw_main
+#include    "../ps2spi.c"
+#undef      main
+
+#define     NSEC_PER_USEC   1000ULL
+#define     NSEC_PER_SEC    1000000000ULL
+
+#define     PS2_HALF_NS     40000ULL    // Keyboard clock half period, 12.5kHz
+#define     PS2_GAP_NS      100000ULL   // Idle time after each keyboard frame
+#define     PS2_REPLY_NS    500000ULL   // Keyboard model reply delay
+#define     PS2_FRAME_EDGES 22          // Clock edges of an 11 bit frame
+#define     TICK_NS         1000000ULL  // Timer0 tick
+
+#define     DEF_KEYS        1000        // Built-in workload key presses
+#define     DEF_RATE        10          // Built-in workload key presses per second
+#define     DEF_HOLD_NS     60000000ULL // Built-in workload key press time
+#define     DEF_POLL_US     10000       // Host poll period
+#define     DEF_SPEED       500000      // SCLK Hz
+#define     DEF_GAP         75          // uSec after each SPI byte, as DEF_GAP of rpi/ps2spi_bench.c
+#define     DEF_LOOP_US     20          // Main loop pass period
+
+#define     XLATE_MIN_CODES 1000000     // Scan codes timed for the throughput figure
+#define     KBD_REPLY_MAX   8           // Keyboard model reply queue
+
+/* Estimated ISR cycles for the ISR timing check, worst case of each ISR including
+ * the prologue. The stop bit edge is the PS2_CLOCK_vect budget in ps2spi.c, the other
+ * PS2 clock edges are shorter. These are hand counts, not measurements, compare
+ * them with the INSTRUMENT statistics of a device build.
+ */
+#define     PS2_STOP_CYCLES (78 + (INSTRUMENT ? 60 : 0) + (TRACE_BUFF_SIZE ? 46 : 0) + (ISR_XLATE ? 220 : 0))
+#define     PS2_EDGE_CYCLES (64 + (INSTRUMENT ? 36 : 0) + (ISR_XLATE ? 30 : 0))
+#define     SPI_ISR_CYCLES  210         // SPI ISR up to the counter re-arm
+#define     SS_ISR_CYCLES   40          // SS pin change ISR, ATmega328P
+#define     TICK_ISR_CYCLES 60          // Timer0 tick with the receiver resync
+
+// Workload event kinds, the receive error kinds use the TRACE_ERR receiver states
+#define     EVENT_FRAME     0           // Valid frame
+#define     EVENT_START     PS2_RX_ERR_START
+#define     EVENT_PARITY    PS2_RX_ERR_PARITY
+#define     EVENT_STOP      PS2_RX_ERR_STOP
+
+typedef struct
+{
+    uint64_t time;          // nSec of the earliest start of the frame
+    uint8_t  data;          // Byte
+    uint8_t  kind;          // EVENT_*
+} event_t;
+
+typedef enum
+{
+    KBD_IDLE,               // Waiting for a byte to send or a host request to send
+    KBD_SEND,               // Clocking a frame to the AVR
+    KBD_RECV,               // Clocking a frame from the AVR
+} kbd_model_state_t;
+
+typedef enum
+{
+    READ_POLL,              // Poll command until a 0 is returned
+    READ_BURST,             // Burst command for all pending key codes
+    READ_DRDY,              // Data ready status byte, and a burst when key codes are pending
+} read_method_t;
+
+typedef enum
+{
+    HOST_IDLE,
+    HOST_POLL,              // Poll sent, NOP next
+    HOST_POLL_CODE,         // NOP sent, its response is the key code
+    HOST_BURST,             // Burst sent, NOP next
+    HOST_BURST_COUNT,       // NOP sent, its response is the count
+    HOST_BURST_CODE,        // NOP sent, its response is a key code
+    HOST_STATUS,            // Data ready NOP sent, its response is the status
+} host_state_t;
+
+/****************************************************************************
+  Function prototypes
+****************************************************************************/
+int      workload_typing(int keys, int rate);
+int      workload_trace(const char *path);
+int      workload_add(uint64_t time, uint8_t data, uint8_t kind);
+int      event_compare(const void *, const void *);
+
+void     line_update(void);
+void     kbd_clock_set(uint8_t level);
+void     kbd_model_step(void);
+void     kbd_frame_start(uint8_t data, uint8_t kind);
+void     kbd_frame_end(void);
+void     kbd_frame_bits(uint8_t data, uint8_t kind);
+void     kbd_reply(uint8_t command);
+void     kbd_reply_put(uint8_t data);
+
+void     host_step(void);
+int      host_next(uint8_t rx);
+void     host_code(uint8_t code);
+
+void     dropped_check(void);
+void     replay(uint64_t drain);
+double   xlate_throughput(void);
+double   hist_mean(volatile uint16_t *hist);
+void     usage(void);
+uint64_t isr_enter(uint32_t cycles);
+
+/****************************************************************************
+  Globals
+****************************************************************************/
+// Workload
+event_t            *events = NULL;
+int                 event_count = 0;
+int                 event_max = 0;
+int                 event_next = 0;
+int                 trace_replies = 0;      // Keyboard replies come from the trace
+
+// Simulation time, nSec
+uint64_t            now = 0;
+uint64_t            tick_time = TICK_NS;
+uint64_t            loop_time = 0;
+uint64_t            loop_ns = DEF_LOOP_US * NSEC_PER_USEC;
+
+// Keyboard model and its side of the PS2 lines, 1 released
+kbd_model_state_t   kbd_state = KBD_IDLE;
+uint64_t            kbd_time = 0;
+uint8_t             kbd_clock = 1;
+uint8_t             kbd_data = 1;
+uint8_t             kbd_bits[PS2_FRAME_EDGES / 2];
+int                 kbd_edge = 0;
+int                 kbd_edges = 0;
+uint8_t             kbd_sending = 0;        // Byte of the frame in progress
+uint8_t             kbd_sending_kind = 0;
+int                 kbd_sending_event = -1; // Workload event of the frame in progress, -1 a reply
+uint8_t             kbd_last_sent = 0;      // For RESEND
+uint8_t             kbd_arg_for = 0;        // Command whose data byte is expected next
+uint8_t             kbd_replies[KBD_REPLY_MAX];
+int                 kbd_reply_count = 0;
+uint64_t            kbd_reply_time = 0;
+
+// Host model
+read_method_t       host_method = READ_POLL;
+host_state_t        host_state = HOST_IDLE;
+uint64_t            host_poll_ns = DEF_POLL_US * NSEC_PER_USEC;
+uint64_t            host_poll_time = 0;
+uint64_t            host_time = 0;          // End of the next SPI byte
+uint64_t            host_byte_ns = 0;       // SCLK byte time
+uint64_t            host_gap_ns = DEF_GAP * NSEC_PER_USEC;
+uint8_t             host_tx = 0;
+int                 host_left = 0;
+FILE               *codes_file = NULL;
+
+// Results
+unsigned long       frames_sent = 0;
+unsigned long       errors_sent = 0;
+unsigned long       replies_sent = 0;
+unsigned long       codes_read = 0;
+unsigned long       spi_transactions = 0;
+unsigned long       spi_bytes = 0;
+unsigned long       key_drops = 0;
+unsigned long       ps2_overruns = 0;
+unsigned long       ticks_run = 0;
+unsigned long       ticks_gated = 0;
+int                 tick_gated = 0;         // main() stopped the Timer0 tick for an idle sleep
+uint64_t            isr_busy = 0;           // nSec the running ISR returns
+uint64_t            isr_delay_max = 0;
+unsigned long       ps2_late_edges = 0;     // PS2 clock ISR started after the next clock edge
+unsigned long       spi_late_bytes = 0;     // SPI byte started before the counter re-arm
+
+/* ----------------------------------------------------------------------------
+ * main()
+ *
+ *  Parse the options, build the workload, replay it and report.
+ *
+ *  param:  command line
+ *  return: 0 ok, 1 codes dropped or an ISR late, 2 usage or workload error
+ */
+int main(int argc, char *argv[])
+{
+    const char     *trace_path = NULL;
+    const char     *codes_path = NULL;
+    int             keys = DEF_KEYS;
+    int             rate = DEF_RATE;
+    uint32_t        speed = DEF_SPEED;
+    int             mode = OUT_MODE_XLATE;
+    int             opt;
+    int             quiet = 0;
+    double          xlate_ns = 0;
+
+    while ( (opt = getopt(argc, argv, "f:n:k:m:p:s:g:l:x:o:q")) != -1 )
+    {
+        switch ( opt )
+        {
+            case 'f':
+                trace_path = optarg;
+                break;
+
+            case 'n':
+                keys = atoi(optarg);
+                break;
+
+            case 'k':
+                rate = atoi(optarg);
+                break;
+
+            case 'm':
+                if ( strcmp(optarg, "poll") == 0 )
+                    host_method = READ_POLL;
+                else if ( strcmp(optarg, "burst") == 0 )
+                    host_method = READ_BURST;
+                else if ( strcmp(optarg, "drdy") == 0 )
+                    host_method = READ_DRDY;
+                else
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+
+            case 'p':
+                host_poll_ns = strtoul(optarg, NULL, 0) * NSEC_PER_USEC;
+                break;
+
+            case 's':
+                speed = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'g':
+                host_gap_ns = strtoul(optarg, NULL, 0) * NSEC_PER_USEC;
+                break;
+
+            case 'l':
+                loop_ns = strtoul(optarg, NULL, 0) * NSEC_PER_USEC;
+                break;
+
+            case 'x':
+                mode = strtol(optarg, NULL, 0);
+                break;
+
+            case 'o':
+                codes_path = optarg;
+                break;
+
+            case 'q':
+                quiet = 1;
+                break;
+
+            default:
+                usage();
+                return 2;
+        }
+    }
+
+    if ( keys <= 0 || rate <= 0 || speed == 0 || host_poll_ns == 0 || loop_ns == 0 )
+    {
+        usage();
+        return 2;
+    }
+
+    host_byte_ns = 8 * NSEC_PER_SEC / speed;
+
+    if ( trace_path )
+    {
+        if ( workload_trace(trace_path) < 0 )
+        {
+            fprintf(stderr, "cannot read trace %s\n", trace_path);
+            return 2;
+        }
+        trace_replies = 1;
+    }
+    else if ( workload_typing(keys, rate) < 0 )
+    {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    if ( codes_path && (codes_file = fopen(codes_path, "w")) == NULL )
+    {
+        fprintf(stderr, "cannot write %s\n", codes_path);
+        return 2;
+    }
+
+    /* Start as kbd_init() leaves a set 1 keyboard, the model does not run
+     * the start-up sequence
+     */
+    kbd_scan_set = 1;
+    kbd_typematic_state = kbd_typematic;
+#ifdef SPI_SS_vect
+    PINB |= SPI_SS;
+#endif
+    line_update();
+
+    if ( host_method == READ_DRDY )
+        mode |= OUT_MODE_DRDY;
+    output_mode = (uint8_t) mode;
+
+    // Run one second past the last frame, so the host reads everything
+    replay(NSEC_PER_SEC);
+
+    if ( codes_file )
+        fclose(codes_file);
+
+    if ( !quiet )
+        xlate_ns = xlate_throughput();
+
+    printf("workload: %s, %d PS2 bytes\n", ( trace_path ) ? trace_path : "built-in typing", event_count);
+    printf("simulated %.3f sec, %lu frames, %lu bad frames and %lu keyboard replies sent, %lu key codes read\n",
+           (double) now / NSEC_PER_SEC, frames_sent, errors_sent, replies_sent, codes_read);
+    printf("SPI: %lu transactions, %lu bytes\n", spi_transactions, spi_bytes);
+    printf("Timer0: %lu ticks, %lu ticks gated in idle sleep\n", ticks_run, ticks_gated);
+    printf("dropped: %lu key code buffer overflows, %lu PS2 input buffer overruns\n",
+           key_drops, ps2_overruns);
+    printf("PS2 errors: start %u, parity %u, stop %u, overrun %lu, timeout %u, resend %u\n",
+           ps2_errors.start, ps2_errors.parity, ps2_errors.stop,
+           ps2_overruns, ps2_errors.timeout, ps2_errors.resend);
+    printf("ISR timing at %lu Hz: peak delay %.1f uSec, %lu late PS2 clock edges, %lu SPI bytes before the re-arm\n",
+           (unsigned long) F_CPU, (double) isr_delay_max / NSEC_PER_USEC, ps2_late_edges, spi_late_bytes);
+#if ( INSTRUMENT )
+    printf("FIFO peaks: PS2 input %u of %u, key codes %u of %u\n",
+           stats.ps2_peak, PS2_BUFF_SIZE, stats.key_peak, KEY_BUFF_SIZE);
+    printf("latency: stop bit to key code buffer %.2f mSec, key code buffer to SPI %.2f mSec\n",
+           hist_mean(stats.rx_hist), hist_mean(stats.tx_hist));
+#endif
+    if ( xlate_ns > 0 )
+        printf("receive and translation: %.0f nSec per scan code, %.2f M scan codes/sec on this host\n",
+               xlate_ns, 1000.0 / xlate_ns);
+
+    return ( key_drops || ps2_overruns || ps2_late_edges || spi_late_bytes ) ? 1 : 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * workload_typing()
+ *
+ *  Build the built-in workload: 'keys' key presses at 'rate' per second,
+ *  letters, some with left shift and some E0 prefixed cursor keys, from a fixed seed.
+ *
+ *  param:  key presses, key presses per second
+ *  return: 0 ok, -1 out of memory
+ */
+int workload_typing(int keys, int rate)
+{
+    static const uint8_t letters[] =
+    {
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+        0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26,
+        0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x39
+    };
+    static const uint8_t cursor[] = { 0x48, 0x4b, 0x4d, 0x50 };
+
+    uint32_t    seed = 1;
+    uint64_t    time, hold;
+    uint8_t     code;
+    int         i, result = 0;
+
+    for ( i = 0; i < keys && result == 0; i++ )
+    {
+        seed = seed * 1103515245 + 12345;
+        time = (uint64_t) i * NSEC_PER_SEC / rate;
+        hold = DEF_HOLD_NS;
+
+        if ( (seed >> 16) % 10 == 0 )
+        {
+            code = cursor[(seed >> 20) % sizeof(cursor)];
+            result |= workload_add(time, 0xe0, EVENT_FRAME);
+            result |= workload_add(time, code, EVENT_FRAME);
+            result |= workload_add(time + hold, 0xe0, EVENT_FRAME);
+            result |= workload_add(time + hold, code | 0x80, EVENT_FRAME);
+        }
+        else if ( (seed >> 16) % 8 == 1 )
+        {
+            code = letters[(seed >> 20) % sizeof(letters)];
+            result |= workload_add(time, 0x2a, EVENT_FRAME);
+            result |= workload_add(time + hold / 4, code, EVENT_FRAME);
+            result |= workload_add(time + hold, code | 0x80, EVENT_FRAME);
+            result |= workload_add(time + hold + hold / 4, 0xaa, EVENT_FRAME);
+        }
+        else
+        {
+            code = letters[(seed >> 20) % sizeof(letters)];
+            result |= workload_add(time, code, EVENT_FRAME);
+            result |= workload_add(time + hold, code | 0x80, EVENT_FRAME);
+        }
+    }
+
+    // Key presses overlap at high rates, the keyboard sends in time order
+    qsort(events, event_count, sizeof(event_t), event_compare);
+
+    return result;
+}
+
+/* ----------------------------------------------------------------------------
+ * workload_trace()
+ *
+ *  Build the workload from a captured trace. Received bytes become frames,
+ *  start bit, parity and stop bit errors become frames with that error,
+ *  and bytes sent to the keyboard are left to the firmware. The 8 bit ticks
+ *  are unwrapped assuming less than 256 mSec between entries.
+ *  Error entries of complete frames are traced on their stop bit, in the tick of the frame.
+ *
+ *  param:  trace file path
+ *  return: 0 ok, -1 read failed or out of memory
+ */
+int workload_trace(const char *path)
+{
+    FILE       *file;
+    uint8_t     entry[3];
+    uint8_t     last_tick = 0;
+    uint64_t    time = 0;
+    int         first = 1;
+    int         result = 0;
+
+    if ( (file = fopen(path, "rb")) == NULL )
+        return -1;
+
+    while ( result == 0 && fread(entry, sizeof(entry), 1, file) == 1 )
+    {
+        if ( first )
+            last_tick = entry[2];
+        first = 0;
+
+        time += (uint8_t)(entry[2] - last_tick) * TICK_NS;
+        last_tick = entry[2];
+
+        if ( entry[0] == TRACE_RX )
+            result = workload_add(time, entry[1], EVENT_FRAME);
+        else if ( entry[0] == TRACE_ERR &&
+                  (entry[1] == EVENT_START || entry[1] == EVENT_PARITY || entry[1] == EVENT_STOP) )
+            result = workload_add(time, 0, entry[1]);
+    }
+
+    fclose(file);
+
+    return result;
+}
+
+/* ----------------------------------------------------------------------------
+ * workload_add()
+ *
+ *  Append an event to the workload.
+ *
+ *  param:  nSec, byte, EVENT_* kind
+ *  return: 0 ok, -1 out of memory
+ */
+int workload_add(uint64_t time, uint8_t data, uint8_t kind)
+{
+    event_t    *grown;
+
+    if ( event_count == event_max )
+    {
+        event_max = ( event_max ) ? event_max * 2 : 1024;
+        grown = realloc(events, event_max * sizeof(event_t));
+        if ( grown == NULL )
+            return -1;
+        events = grown;
+    }
+
+    events[event_count].time = time;
+    events[event_count].data = data;
+    events[event_count].kind = kind;
+    event_count++;
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * event_compare()
+ *
+ *  qsort() order of workload events by time, events at the same time
+ *  keep the order they were added in.
+ *
+ *  param:  events
+ *  return: <0, 0, >0
+ */
+int event_compare(const void *a, const void *b)
+{
+    const event_t  *ea = a;
+    const event_t  *eb = b;
+
+    if ( ea->time != eb->time )
+        return ( ea->time < eb->time ) ? -1 : 1;
+
+    return ( ea < eb ) ? -1 : ( ea > eb );
+}
+
+/* ----------------------------------------------------------------------------
+ * line_update()
+ *
+ *  Set the PS2 input pins from the lines, each is low when the keyboard
+ *  or the AVR drives it low, and high otherwise through its pull up.
+ *
+ *  param:  none
+ *  return: none
+ */
+void line_update(void)
+{
+    uint8_t pins = PS2_PIN & ~(PS2_CLOCK | PS2_DATA);
+
+    if ( kbd_clock && !((PS2_DDR & PS2_CLOCK) && !(PS2_PORT & PS2_CLOCK)) )
+        pins |= PS2_CLOCK;
+
+    if ( kbd_data && !((PS2_DDR & PS2_DATA) && !(PS2_PORT & PS2_DATA)) )
+        pins |= PS2_DATA;
+
+    PS2_PIN = pins;
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_clock_set()
+ *
+ *  Drive or release the clock line from the keyboard and call the pin change ISR.
+ *
+ *  param:  1 release, 0 drive low
+ *  return: none
+ */
+void kbd_clock_set(uint8_t level)
+{
+    kbd_clock = level;
+    line_update();
+
+    tick_gated = 0;
+    if ( isr_enter(( kbd_edge == PS2_FRAME_EDGES - 2 ) ? PS2_STOP_CYCLES : PS2_EDGE_CYCLES) >= PS2_HALF_NS )
+        ps2_late_edges++;
+    PS2_CLOCK_vect();
+
+    line_update();
+    dropped_check();
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_model_step()
+ *
+ *  Advance the keyboard model to 'now'. An idle keyboard starts clocking a host
+ *  to keyboard frame when the AVR requests to send, and otherwise sends the next
+ *  reply or workload byte that is due while the AVR does not inhibit the clock.
+ *  A frame is abandoned and sent again when the AVR inhibits the clock during it.
+ *
+ *  param:  none
+ *  return: none
+ */
+void kbd_model_step(void)
+{
+    uint8_t inhibit = (PS2_DDR & PS2_CLOCK) && !(PS2_PORT & PS2_CLOCK);
+    uint8_t request = (PS2_DDR & PS2_DATA) && !(PS2_PORT & PS2_DATA);
+    int     i;
+
+    if ( kbd_state == KBD_IDLE )
+    {
+        if ( now < kbd_time || inhibit )
+            return;
+
+        if ( request )
+        {
+            kbd_state = KBD_RECV;
+            kbd_edge = 0;
+            kbd_edges = PS2_FRAME_EDGES;
+            kbd_time = now + PS2_HALF_NS;
+        }
+        else if ( kbd_reply_count && now >= kbd_reply_time )
+        {
+            kbd_sending_event = -1;
+            kbd_frame_start(kbd_replies[0], EVENT_FRAME);
+            kbd_reply_count--;
+            for ( i = 0; i < kbd_reply_count; i++ )
+                kbd_replies[i] = kbd_replies[i + 1];
+        }
+        else if ( event_next < event_count && now >= events[event_next].time )
+        {
+            kbd_sending_event = event_next;
+            kbd_frame_start(events[event_next].data, events[event_next].kind);
+            event_next++;
+        }
+        return;
+    }
+
+    /* ps2_send() releases the clock before the model runs again,
+     * so the request to send also shows that the AVR inhibited the frame.
+     * The frame is complete after its 11th falling edge, and is abandoned before it
+     */
+    if ( kbd_state == KBD_SEND && (inhibit || request) )
+    {
+        if ( kbd_clock == 0 )
+            kbd_clock_set(1);
+
+        if ( kbd_edge >= PS2_FRAME_EDGES - 1 )
+        {
+            kbd_frame_end();
+            return;
+        }
+
+        // Send the abandoned frame again after the AVR's transmit
+        kbd_data = 1;
+        kbd_state = KBD_IDLE;
+        line_update();
+        if ( kbd_sending_event >= 0 )
+            event_next = kbd_sending_event;
+        else
+            kbd_reply_put(kbd_sending);
+        return;
+    }
+
+    if ( now < kbd_time )
+        return;
+
+    if ( kbd_state == KBD_SEND )
+    {
+        if ( (kbd_edge & 1) == 0 )
+        {
+            kbd_data = kbd_bits[kbd_edge / 2];
+            kbd_clock_set(0);
+        }
+        else
+            kbd_clock_set(1);
+    }
+    else
+    {
+        // The AVR changes data after the falling edge, the keyboard samples it on the rising edge
+        i = kbd_edge / 2;
+        if ( (kbd_edge & 1) == 0 )
+        {
+            if ( i == 10 )
+            {
+                kbd_data = 0;
+                line_update();
+            }
+            kbd_clock_set(0);
+        }
+        else
+        {
+            if ( i < 10 )
+                kbd_bits[i] = (PS2_PIN & PS2_DATA) ? 1 : 0;
+            kbd_clock_set(1);
+        }
+    }
+
+    kbd_edge++;
+    kbd_time += PS2_HALF_NS;
+
+    if ( kbd_edge == kbd_edges )
+        kbd_frame_end();
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_frame_end()
+ *
+ *  End the frame in progress: release the data line, count a frame sent,
+ *  or answer a frame received, and idle for the gap between frames.
+ *
+ *  param:  none
+ *  return: none
+ */
+void kbd_frame_end(void)
+{
+    int     i;
+
+    kbd_data = 1;
+    line_update();
+
+    if ( kbd_state == KBD_RECV )
+    {
+        uint8_t command = 0;
+
+        for ( i = 0; i < 8; i++ )
+            command |= kbd_bits[i] << i;
+        if ( !trace_replies )
+            kbd_reply(command);
+    }
+    else if ( kbd_sending_event < 0 )
+        replies_sent++;
+    else if ( kbd_sending_kind == EVENT_FRAME )
+        frames_sent++;
+    else
+        errors_sent++;
+
+    kbd_state = KBD_IDLE;
+    kbd_time = now + PS2_GAP_NS;
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_frame_start()
+ *
+ *  Start clocking a frame from the keyboard.
+ *
+ *  param:  byte, EVENT_* kind
+ *  return: none
+ */
+void kbd_frame_start(uint8_t data, uint8_t kind)
+{
+    kbd_frame_bits(data, kind);
+
+    kbd_sending = data;
+    kbd_sending_kind = kind;
+    if ( kind == EVENT_FRAME )
+        kbd_last_sent = data;
+
+    kbd_state = KBD_SEND;
+    kbd_edge = 0;
+    kbd_edges = PS2_FRAME_EDGES;
+    kbd_time = now;
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_frame_bits()
+ *
+ *  Fill 'kbd_bits[]' with the start bit, eight data bits LSB first,
+ *  odd parity and the stop bit, with the error of the event kind.
+ *
+ *  param:  byte, EVENT_* kind
+ *  return: none
+ */
+void kbd_frame_bits(uint8_t data, uint8_t kind)
+{
+    uint8_t parity = 1;
+    int     i;
+
+    kbd_bits[0] = ( kind == EVENT_START ) ? 1 : 0;
+    for ( i = 0; i < 8; i++ )
+    {
+        kbd_bits[1 + i] = (data >> i) & 0x01;
+        parity ^= kbd_bits[1 + i];
+    }
+    kbd_bits[9] = ( kind == EVENT_PARITY ) ? !parity : parity;
+    kbd_bits[10] = ( kind == EVENT_STOP ) ? 0 : 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_reply()
+ *
+ *  Keyboard model answer to a byte from the AVR: ACK to commands and their
+ *  data bytes, the scan code set 1 ID to a set query, ECHO, BAT after a reset,
+ *  and the last byte again for RESEND.
+ *
+ *  param:  byte received from the AVR
+ *  return: none
+ */
+void kbd_reply(uint8_t command)
+{
+    if ( kbd_arg_for )
+    {
+        kbd_reply_put(PS2_KH_ACK);
+        if ( kbd_arg_for == PS2_HK_ALTCODE && command == 0 )
+            kbd_reply_put(PS2_SET1_ID);
+        kbd_arg_for = 0;
+        return;
+    }
+
+    switch ( command )
+    {
+        case PS2_HK_ECHO:
+            kbd_reply_put(PS2_KH_ECHO);
+            break;
+
+        case PS2_HK_RESEND:
+            kbd_reply_put(kbd_last_sent);
+            break;
+
+        case PS2_HK_RESET:
+            kbd_reply_put(PS2_KH_ACK);
+            kbd_reply_put(PS2_KH_BATOK);
+            break;
+
+        case PS2_HK_LEDS:
+        case PS2_HK_TMDELAY:
+        case PS2_HK_ALTCODE:
+            kbd_arg_for = command;
+            kbd_reply_put(PS2_KH_ACK);
+            break;
+
+        default:
+            kbd_reply_put(PS2_KH_ACK);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_reply_put()
+ *
+ *  Queue a keyboard reply, sent ahead of the workload.
+ *
+ *  param:  byte
+ *  return: none
+ */
+void kbd_reply_put(uint8_t data)
+{
+    if ( kbd_reply_count == KBD_REPLY_MAX )
+        return;
+
+    if ( kbd_reply_count == 0 )
+        kbd_reply_time = now + PS2_REPLY_NS;
+
+    kbd_replies[kbd_reply_count++] = data;
+}
+
+/* ----------------------------------------------------------------------------
+ * host_step()
+ *
+ *  Advance the host model to 'now'. A read starts on each poll period,
+ *  and each byte is handed to SPI_XFER_vect when its last bit is clocked.
+ *
+ *  param:  none
+ *  return: none
+ */
+void host_step(void)
+{
+    uint64_t    delay;
+    int         next;
+    uint8_t     rx;
+
+    if ( host_state == HOST_IDLE )
+    {
+        if ( now < host_poll_time )
+            return;
+
+        host_poll_time += host_poll_ns;
+        spi_transactions++;
+
+        tick_gated = 0;
+#ifdef SPI_SS_vect
+        PINB &= ~SPI_SS;
+        isr_enter(SS_ISR_CYCLES);
+        SPI_SS_vect();
+#endif
+        host_state = ( host_method == READ_POLL ) ? HOST_POLL :
+                     ( host_method == READ_BURST ) ? HOST_BURST : HOST_STATUS;
+        host_tx = ( host_method == READ_POLL ) ? SPI_CMD_POLL :
+                  ( host_method == READ_BURST ) ? SPI_CMD_BURST : SPI_CMD_NOP;
+        host_time = now + host_byte_ns;
+        return;
+    }
+
+    if ( now < host_time )
+        return;
+
+    // The byte in SPI_DATA is shifted out as the host's byte is shifted in
+    rx = SPI_DATA;
+    SPI_DATA = host_tx;
+    tick_gated = 0;
+    delay = isr_enter(SPI_ISR_CYCLES);
+    SPI_XFER_vect();
+    spi_bytes++;
+    dropped_check();
+
+    next = host_next(rx);
+    if ( next < 0 )
+    {
+        host_state = HOST_IDLE;
+#ifdef SPI_SS_vect
+        PINB |= SPI_SS;
+        isr_enter(SS_ISR_CYCLES);
+        SPI_SS_vect();
+#endif
+        return;
+    }
+
+    if ( delay + (uint64_t) SPI_ISR_CYCLES * NSEC_PER_SEC / F_CPU > host_gap_ns )
+        spi_late_bytes++;
+
+    host_tx = (uint8_t) next;
+    host_time = now + host_gap_ns + host_byte_ns;
+}
+
+/* ----------------------------------------------------------------------------
+ * host_next()
+ *
+ *  Host read state machine, like the Raspberry Pi client.
+ *
+ *  param:  byte received while the last byte was sent
+ *  return: next byte to send, -1 end of the read
+ */
+int host_next(uint8_t rx)
+{
+    switch ( host_state )
+    {
+        case HOST_POLL:
+            host_state = HOST_POLL_CODE;
+            return SPI_CMD_NOP;
+
+        case HOST_POLL_CODE:
+            if ( rx == 0 )
+                return -1;
+            host_code(rx);
+            host_state = HOST_POLL;
+            return SPI_CMD_POLL;
+
+        case HOST_STATUS:
+            if ( (rx & SPI_STAT_DEPTH) == 0 )
+                return -1;
+            host_state = HOST_BURST;
+            return SPI_CMD_BURST;
+
+        case HOST_BURST:
+            host_state = HOST_BURST_COUNT;
+            return SPI_CMD_NOP;
+
+        case HOST_BURST_COUNT:
+            host_left = rx;
+            if ( host_left == 0 )
+                return -1;
+            host_state = HOST_BURST_CODE;
+            return SPI_CMD_NOP;
+
+        case HOST_BURST_CODE:
+            host_code(rx);
+            if ( --host_left == 0 )
+                return -1;
+            return SPI_CMD_NOP;
+
+        default:
+            return -1;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * host_code()
+ *
+ *  Count a key code read by the host, and write it to the '-o' file.
+ *
+ *  param:  key code
+ *  return: none
+ */
+void host_code(uint8_t code)
+{
+    codes_read++;
+
+    if ( codes_file )
+        fprintf(codes_file, "%02x\n", code);
+}
+
+/* ----------------------------------------------------------------------------
+ * dropped_check()
+ *
+ *  Count key codes dropped for a full key code buffer, and scan codes dropped for
+ *  a full PS2 input buffer. The firmware flag is sticky until the host reads Status,
+ *  and the overrun counter saturates, so the harness clears both after counting.
+ *
+ *  param:  none
+ *  return: none
+ */
+void dropped_check(void)
+{
+    if ( key_overflow )
+    {
+        key_drops++;
+        key_overflow = 0;
+    }
+
+    if ( ps2_errors.overrun )
+    {
+        ps2_overruns += ps2_errors.overrun;
+        ps2_errors.overrun = 0;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * isr_enter()
+ *
+ *  Account for an ISR requested at 'now' that runs for 'cycles'. AVR ISRs do not nest,
+ *  so an ISR requested while another one runs starts when that one returns.
+ *  Only the timing is tracked, the ISR logic still runs at 'now'.
+ *
+ *  param:  estimated ISR cycles
+ *  return: nSec from the request to the ISR start
+ */
+uint64_t isr_enter(uint32_t cycles)
+{
+    uint64_t    start;
+
+    start = ( isr_busy > now ) ? isr_busy : now;
+    isr_busy = start + (uint64_t) cycles * NSEC_PER_SEC / F_CPU;
+
+    if ( start - now > isr_delay_max )
+        isr_delay_max = start - now;
+
+    return start - now;
+}
+
+/* ----------------------------------------------------------------------------
+ * replay()
+ *
+ *  Run the simulation until 'drain' after the keyboard model sent the last workload
+ *  frame, stepping to the earliest of the next Timer0 tick, keyboard model edge,
+ *  host SPI byte and main loop pass.
+ *
+ *  param:  nSec to run after the workload
+ *  return: none
+ */
+void replay(uint64_t drain)
+{
+    uint64_t    next;
+    uint64_t    end = 0;
+
+    while ( end == 0 || now < end )
+    {
+        if ( end == 0 && event_next == event_count && kbd_state == KBD_IDLE )
+            end = now + drain;
+
+        if ( now >= tick_time )
+        {
+            if ( tick_gated )
+            {
+                ticks_gated++;
+            }
+            else
+            {
+                isr_enter(TICK_ISR_CYCLES);
+                TIMER0_COMPA_vect();
+                ticks_run++;
+            }
+            tick_time += TICK_NS;
+        }
+
+        kbd_model_step();
+        host_step();
+
+        if ( now >= loop_time )
+        {
+            kbd_process();
+            line_update();
+            dropped_check();
+#if ( IDLE_SLEEP && TICK_GATE )
+            tick_gated = kbd_idle() && kbd_tick_idle();
+#endif
+            loop_time += loop_ns;
+        }
+
+        next = tick_time;
+        if ( loop_time < next )
+            next = loop_time;
+        if ( kbd_state != KBD_IDLE && kbd_time < next )
+            next = kbd_time;
+        if ( kbd_state == KBD_IDLE && kbd_time > now && kbd_time < next )
+            next = kbd_time;
+        if ( host_state == HOST_IDLE && host_poll_time < next )
+            next = host_poll_time;
+        if ( host_state != HOST_IDLE && host_time < next )
+            next = host_time;
+
+        now = ( next > now ) ? next : now + 1;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * xlate_throughput()
+ *
+ *  Time the firmware receive and translation path on this host: each valid
+ *  workload byte is clocked into PS2_CLOCK_vect as a frame and kbd_process()
+ *  runs until the PS2 input buffer is empty. The key codes are discarded.
+ *
+ *  param:  none
+ *  return: nSec per scan code, 0 for an empty workload
+ */
+double xlate_throughput(void)
+{
+    struct timespec start, stop;
+    unsigned long   count = 0;
+    double          elapsed;
+    int             i, edge;
+
+    for ( i = 0; i < event_count && events[i].kind != EVENT_FRAME; i++ )
+        ;
+    if ( i == event_count )
+        return 0;
+
+#if ( TRACE_BUFF_SIZE )
+    trace_on = 0;
+#endif
+    kbd_data = 1;
+    kbd_clock = 1;
+    line_update();
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+
+    while ( count < XLATE_MIN_CODES )
+    {
+        for ( i = 0; i < event_count; i++ )
+        {
+            if ( events[i].kind != EVENT_FRAME )
+                continue;
+
+            kbd_frame_bits(events[i].data, EVENT_FRAME);
+            for ( edge = 0; edge < PS2_FRAME_EDGES; edge++ )
+            {
+                if ( (edge & 1) == 0 )
+                    kbd_data = kbd_bits[edge / 2];
+                kbd_clock = edge & 1;
+                line_update();
+                PS2_CLOCK_vect();
+            }
+
+            while ( ps2_buffer_in != ps2_buffer_out )
+                kbd_process();
+
+            key_buffer_out = key_buffer_in;
+            spi_key_staged = 0;
+            count++;
+        }
+    }
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &stop);
+
+    elapsed = (stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec);
+
+    return elapsed / count;
+}
+
+/* ----------------------------------------------------------------------------
+ * hist_mean()
+ *
+ *  Mean latency of a firmware latency histogram from its bin mid points.
+ *
+ *  param:  histogram of STATS_BINS bins
+ *  return: mean mSec, 0 for an empty histogram
+ */
+double hist_mean(volatile uint16_t *hist)
+{
+    static const double mid[STATS_BINS] = { 0, 1, 2.5, 5.5, 11.5, 23.5, 47.5, 64 };
+
+    double  sum = 0, count = 0;
+    int     i;
+
+    for ( i = 0; i < STATS_BINS; i++ )
+    {
+        sum += hist[i] * mid[i];
+        count += hist[i];
+    }
+
+    return ( count > 0 ) ? sum / count : 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * usage()
+ *
+ *  Print the command line options.
+ *
+ *  param:  none
+ *  return: none
+ */
+void usage(void)
+{
+    fprintf(stderr,
+            "usage: ps2spi_replay [-f trace] [-n keys] [-k keys_per_sec] [-m poll|burst|drdy]\n"
+            "                     [-p poll_us] [-s sclk_hz] [-g gap_us] [-l loop_us]\n"
+            "                     [-x mode] [-o codes_file] [-q]\n"
+            "  -f  replay a trace captured with the Trace command instead of the built-in typing\n"
+            "  -n  built-in workload key presses, default %d\n"
+            "  -k  built-in workload key presses per second, default %d\n"
+            "  -m  host read method, default poll\n"
+            "  -p  host poll period, default %d uSec\n"
+            "  -s  SCLK, default %d Hz\n"
+            "  -g  gap after each SPI byte, default %d uSec\n"
+            "  -l  main loop pass period, default %d uSec\n"
+            "  -x  output mode byte, default 0\n"
+            "  -o  write the key codes read to a file, one hex byte per line\n"
+            "  -q  leave out the host CPU time of the receive and translation path\n",
+            DEF_KEYS, DEF_RATE, DEF_POLL_US, DEF_SPEED, DEF_GAP, DEF_LOOP_US);
+}
@@ -0,0 +1,15 @@
+/*
+ * util/atomic.h
+ *
+ *  Host stub: the block runs once, the harness never calls an ISR inside it.
+ *
+ */
+
+#ifndef __HOST_UTIL_ATOMIC_H__
+#define __HOST_UTIL_ATOMIC_H__
+
+#define     ATOMIC_RESTORESTATE     0
+
+#define     ATOMIC_BLOCK(type)      for ( int atomic_once = 1; atomic_once; atomic_once = 0 )
+
+#endif  /* __HOST_UTIL_ATOMIC_H__ */
@@ -0,0 +1,14 @@
+/*
+ * util/delay.h
+ *
+ *  Host stub: busy wait delays return at once, the harness keeps simulated time.
+ *
+ */
+
+#ifndef __HOST_UTIL_DELAY_H__
+#define __HOST_UTIL_DELAY_H__
+
+#define     _delay_ms(ms)
+#define     _delay_us(us)
+
+#endif  /* __HOST_UTIL_DELAY_H__ */
@@ -0,0 +1,95 @@
+/*
+ * keymap.h
+ *
+ *  Declarative keymap for the Dragon 32/64 and CoCo translation.
+ *  This file is included by ps2spi.c to generate the flash-resident
+ *  scan code translation tables at compile time. Scan codes without an entry
+ *  are discarded, so adding or removing a key is a data change only.
+ *
+ *  KEY(scan, key, dragon, coco)
+ *      Set 1 make code 'scan' and its break code are passed as key code 'key',
+ *      in range 1 to PS2_LAST_CODE, 'dragon' and 'coco' are its keyboard
+ *      matrix positions MTX(row, column) or auxiliary key codes AUX(n)
+ *  ALIAS(scan, key)
+ *      Set 1 make code 'scan' is passed as the key code of another KEY
+ *  KEY_E0(scan, key)
+ *      Make code 'scan' following an 'E0' prefix is passed, without
+ *      the prefix, as the key code of a KEY
+ *
+ *  Tab, Ctrl, Alt, Caps lock, ] ' ` \ keys, and most of the keypad are discarded.
+ *  After 'E0' only the arrow keys are kept, which reduces any keyboard to
+ *  the equivalent of an 83 key keyboard.
+ *
+ *  No include guard, the file is included once per generated table.
+ *
+ */
+
+KEY(0x01, 0x01, MTX(6, 2), MTX(6, 2))       // Esc as BREAK
+KEY(0x02, 0x02, MTX(0, 1), MTX(4, 1))       // 1
+KEY(0x03, 0x03, MTX(0, 2), MTX(4, 2))       // 2
+KEY(0x04, 0x04, MTX(0, 3), MTX(4, 3))       // 3
+KEY(0x05, 0x05, MTX(0, 4), MTX(4, 4))       // 4
+KEY(0x06, 0x06, MTX(0, 5), MTX(4, 5))       // 5
+KEY(0x07, 0x07, MTX(0, 6), MTX(4, 6))       // 6
+KEY(0x08, 0x08, MTX(0, 7), MTX(4, 7))       // 7
+KEY(0x09, 0x09, MTX(1, 0), MTX(5, 0))       // 8
+KEY(0x0a, 0x0a, MTX(1, 1), MTX(5, 1))       // 9
+KEY(0x0b, 0x0b, MTX(0, 0), MTX(4, 0))       // 0
+KEY(0x0c, 0x0c, MTX(1, 5), MTX(5, 5))       // -
+KEY(0x0d, 0x0d, MTX(1, 2), MTX(5, 2))       // = as :
+KEY(0x0e, 0x0e, MTX(5, 5), MTX(3, 5))       // Backspace as LEFT
+KEY(0x10, 0x10, MTX(4, 1), MTX(2, 1))       // Q
+KEY(0x11, 0x11, MTX(4, 7), MTX(2, 7))       // W
+KEY(0x12, 0x12, MTX(2, 5), MTX(0, 5))       // E
+KEY(0x13, 0x13, MTX(4, 2), MTX(2, 2))       // R
+KEY(0x14, 0x14, MTX(4, 4), MTX(2, 4))       // T
+KEY(0x15, 0x15, MTX(5, 1), MTX(3, 1))       // Y
+KEY(0x16, 0x16, MTX(4, 5), MTX(2, 5))       // U
+KEY(0x17, 0x17, MTX(3, 1), MTX(1, 1))       // I
+KEY(0x18, 0x18, MTX(3, 7), MTX(1, 7))       // O
+KEY(0x19, 0x19, MTX(4, 0), MTX(2, 0))       // P
+KEY(0x1a, 0x1a, MTX(2, 0), MTX(0, 0))       // [ as @
+KEY(0x1c, 0x1c, MTX(6, 0), MTX(6, 0))       // Enter as ENTER
+KEY(0x1e, 0x1e, MTX(2, 1), MTX(0, 1))       // A
+KEY(0x1f, 0x1f, MTX(4, 3), MTX(2, 3))       // S
+KEY(0x20, 0x20, MTX(2, 4), MTX(0, 4))       // D
+KEY(0x21, 0x21, MTX(2, 6), MTX(0, 6))       // F
+KEY(0x22, 0x22, MTX(2, 7), MTX(0, 7))       // G
+KEY(0x23, 0x23, MTX(3, 0), MTX(1, 0))       // H
+KEY(0x24, 0x24, MTX(3, 2), MTX(1, 2))       // J
+KEY(0x25, 0x25, MTX(3, 3), MTX(1, 3))       // K
+KEY(0x26, 0x26, MTX(3, 4), MTX(1, 4))       // L
+KEY(0x27, 0x27, MTX(1, 3), MTX(5, 3))       // ;
+KEY(0x2a, 0x2a, MTX(6, 7), MTX(6, 7))       // Left shift as SHIFT
+KEY(0x2c, 0x2c, MTX(5, 2), MTX(3, 2))       // Z
+KEY(0x2d, 0x2d, MTX(5, 0), MTX(3, 0))       // X
+KEY(0x2e, 0x2e, MTX(2, 3), MTX(0, 3))       // C
+KEY(0x2f, 0x2f, MTX(4, 6), MTX(2, 6))       // V
+KEY(0x30, 0x30, MTX(2, 2), MTX(0, 2))       // B
+KEY(0x31, 0x31, MTX(3, 6), MTX(1, 6))       // N
+KEY(0x32, 0x32, MTX(3, 5), MTX(1, 5))       // M
+KEY(0x33, 0x33, MTX(1, 4), MTX(5, 4))       // ,
+KEY(0x34, 0x34, MTX(1, 6), MTX(5, 6))       // .
+KEY(0x35, 0x35, MTX(1, 7), MTX(5, 7))       // /
+KEY(0x39, 0x39, MTX(5, 7), MTX(3, 7))       // Space as SPACE
+KEY(0x3b, 0x3b, MTX(6, 1), MTX(6, 1))       // F1 as CLEAR
+KEY(0x3c, 0x3c, AUX(2), AUX(2))             // F2
+KEY(0x3d, 0x3d, AUX(3), AUX(3))             // F3
+KEY(0x3e, 0x3e, AUX(4), AUX(4))             // F4
+KEY(0x3f, 0x3f, AUX(5), AUX(5))             // F5
+KEY(0x40, 0x40, AUX(6), AUX(6))             // F6
+KEY(0x41, 0x41, AUX(7), AUX(7))             // F7
+KEY(0x42, 0x42, AUX(8), AUX(8))             // F8
+KEY(0x43, 0x43, AUX(9), AUX(9))             // F9
+KEY(0x44, 0x44, AUX(10), AUX(10))           // F10
+KEY(0x48, 0x48, MTX(5, 3), MTX(3, 3))       // Keypad 8 as UP
+KEY(0x4b, 0x4b, MTX(5, 5), MTX(3, 5))       // Keypad 4 as LEFT
+KEY(0x4d, 0x4d, MTX(5, 6), MTX(3, 6))       // Keypad 6 as RIGHT
+KEY(0x50, 0x50, MTX(5, 4), MTX(3, 4))       // Keypad 2 as DOWN
+
+ALIAS(0x36, 0x2a)                           // Right shift as left shift
+
+KEY_E0(0x48, 0x48)                          // Up arrow
+KEY_E0(0x4b, 0x4b)                          // Left arrow
+KEY_E0(0x4d, 0x4d)                          // Right arrow
+KEY_E0(0x50, 0x50)                          // Down arrow
@@ -23,7 +23,7 @@
  *  +-----+               +-----+            +-------+
  *
  *
- * ATtiny85 AVR IO
+ * ATtiny85 AVR IO, see hal_m328p.h for the ATmega328P target
  *
  * | Function  | AVR  | Pin | I/O               |
  * |-----------|------|-----|-------------------|
@@ -54,43 +54,178 @@
  *
  * Dragon 32 keyboard: http://archive.worldofdragon.org/index.php?title=Keyboard
  *
- * TODO:
- * 1) keyboard error handling and recovery
- *
  */
 
+/* System clock, 8MHz internal RC oscillator by default.
+ * Build with F_CPU=16000000UL for the 16MHz ATtiny85 PLL clock profile, which also needs
+ * the PLL clock fuse (CKSEL=0001, low fuse 0xe1) and VCC of at least 4.5v (sec 21.3 p.163),
+ * or for an ATmega328P with a 16MHz crystal.
+ */
+#ifndef F_CPU
+#define     F_CPU           8000000UL
+#endif
+
 #include    <stdint.h>
 #include    <stdlib.h>
 
 #include    <avr/io.h>
 #include    <avr/interrupt.h>
+#include    <avr/pgmspace.h>
+#include    <avr/sleep.h>
 #include    <avr/wdt.h>
+#include    <util/atomic.h>
 #include    <util/delay.h>
 
-// IO port B initialization
-#define     PB_DDR_INIT     0b00000010  // Port data direction
-#define     PB_PUP_INIT     0b00000000  // Port input pin pull-up
-#define     PB_INIT         0b00000000  // Port initial values
+/* Hardware abstraction, PS2 pin access, SPI slave backend, timers and SRAM arena size
+ * for the target selected with -mmcu
+ */
+#if defined(__AVR_ATtiny85__)
+#include    "hal_tiny85.h"
+#elif defined(__AVR_ATmega328P__)
+#include    "hal_m328p.h"
+#else
+#error "Unsupported target, build for the ATtiny85 or the ATmega328P"
+#endif
+
+#if ( F_CPU != 8000000UL && F_CPU != 16000000UL )
+#error "F_CPU must be 8000000UL or 16000000UL"
+#endif
+
+/* Build options, also set from the command line, for example with -DINSTRUMENT=0
+ */
+// Power
+#ifndef IDLE_SLEEP
+#define     IDLE_SLEEP      1           // Set to 0 to busy-poll instead of sleeping in the main loop
+#endif
+#ifndef TICK_GATE
+#define     TICK_GATE       1           // Set to 0 to keep the Timer0 tick running in idle sleep
+#endif
+
+// Instrumentation
+#ifndef INSTRUMENT
+#define     INSTRUMENT      1           // Set to 0 to remove ISR timing and latency statistics
+#endif
+#define     STATS_BINS      8           // Latency histogram bins: 0, 1, 2-3, 4-7, ... 64+ mSec
+#define     STATS_AVG_SHIFT 4           // ISR cycle average over the last ~16 calls
+#define     WAKE_PROBE_RATE 16          // Idle sleeps per wake-up latency probe
+#define     WAKE_PROBE_LEAD 32          // Cycles from arming the probe to its compare match
+
+// Host to AVR SPI commands, sent by the host as the byte clocked into DI
+#define     SPI_CMD_POLL    0x00        // Return next key code, 0 if none
+#define     SPI_CMD_BURST   0x01        // Return FIFO depth 'n' followed by 'n' key codes
+#define     SPI_CMD_STATUS  0x02        // Return SPI_STAT_* flags and clear them
+#define     SPI_CMD_KEYMAP  0x03        // Return KEY_MAP_SIZE 'n' followed by 'n' bytes of pressed-key bitmap
+#define     SPI_CMD_TYPEMAT 0x10        // Set typematic rate/delay, next byte PS2_HK_TMDELAY encoding
+#define     SPI_CMD_LEDS    0x11        // Set lock LEDs, next byte LED bit mask
+#define     SPI_CMD_FLUSH   0x12        // Discard all buffered scan codes and key codes
+#define     SPI_CMD_MODE    0x13        // Select output mode, next byte OUT_MODE_*
+#define     SPI_CMD_REPEAT  0x14        // Set AVR generated key repeat, next byte KEY_REP_* encoding
+#define     SPI_CMD_STATS   0x20        // Return stats_t size 'n' followed by 'n' bytes of stats_t
+#define     SPI_CMD_STATCLR 0x21        // Clear statistics
+#define     SPI_CMD_ERRORS  0x22        // Return ps2_errors_t size 'n' followed by 'n' bytes of ps2_errors_t
+#define     SPI_CMD_ERRCLR  0x23        // Clear PS2 error counters
+#define     SPI_CMD_TRACE   0x24        // Return trace byte count 'n' followed by 'n' bytes of trace entries
+#define     SPI_CMD_TRCCTL  0x25        // Trace capture control, next byte 1 start (clears trace) 0 stop
+#define     SPI_CMD_NOP     0xff        // Return 0, does not remove a key code
+
+// Output modes
+#define     OUT_MODE_ENC    0x07        // Output encoding bits
+#define     OUT_MODE_XLATE  0x00        // Filtered and translated set 1 key codes for the Dragon
+#define     OUT_MODE_RAW    0x01        // Unfiltered set 1 scan codes, including prefixes
+#define     OUT_MODE_DRAGON 0x02        // Dragon 32 and Dragon 64 keyboard matrix codes
+#define     OUT_MODE_COCO   0x03        // Tandy CoCo keyboard matrix codes
+#define     OUT_MODE_SEQ    0x08        // Each key code frame ends with a KEY_SEQ_* byte
+#define     OUT_MODE_DRDY   0x10        // Idle response is a status byte, DO signals data ready
+#define     OUT_MODE_TIME   0x20        // Each key code is followed by a time delta byte
+#define     OUT_MODE_KEYUP  0x40        // Insert KEY_ALL_UP after a break code was lost to overflow
+#define     OUT_MODE_NOREP  0x80        // Drop keyboard typematic repeats of keys already down
+
+#define     KEY_ALL_UP      0xff        // Marker code, host should release all keys
+
+// Sequence byte ending each key code frame in OUT_MODE_SEQ
+#define     KEY_SEQ_MORE    0x80        // More key codes pending after this frame
+#define     KEY_SEQ_NUM     0x7f        // Rolling sequence number, a gap means key codes were lost
+
+// Declarative keymap the translation tables are generated from
+#ifndef     KEYMAP
+#define     KEYMAP          "keymap.h"
+#endif
+
+// Keyboard matrix code layouts, in OUT_MODE_DRAGON order
+#define     MATRIX_LAYOUTS  2
+#define     MATRIX_KEY      0x08        // Matrix code flag, clear for auxiliary keys
+
+// Pressed-key bitmap, one bit per translated key code 0 to 83
+#define     KEY_MAP_KEYS    84
+#define     KEY_MAP_SIZE    ((KEY_MAP_KEYS + 7) / 8)
+
+// AVR generated key repeat, SPI_CMD_REPEAT data byte, 0 to disable
+#define     KEY_REP_DELAY   0xf0        // Delay before the first repeat, (n + 1) * KEY_REP_DELAY_MS
+#define     KEY_REP_PERIOD  0x0f        // Repeat period, (n + 1) * KEY_REP_PERIOD_MS
+#define     KEY_REP_DELAY_MS    50
+#define     KEY_REP_PERIOD_MS   10
+
+#define     KEY_TIME_MAX    255         // mSec, largest time delta, longer gaps saturate
+#define     KEY_TIME_STALE  200         // mSec, mark time delta saturated before the tick wraps
+
+// Status byte returned as the idle response in OUT_MODE_DRDY
+#define     SPI_STAT_PEND   0x80        // Key codes pending, DO is high between transfers
+#define     SPI_STAT_DEPTH  0x7f        // Key codes pending count
+
+// Flags returned by SPI_CMD_STATUS
+#define     SPI_STAT_OVRFL  0x01        // Key code output buffer overflowed since last read
+#define     SPI_STAT_SET2   0x02        // Keyboard is in scan code set 2, not cleared when read
+#define     SPI_STAT_TROVF  0x04        // Trace buffer was full and entries were dropped since last read
+#define     SPI_STAT_WDRST  0x08        // AVR was restarted by the watchdog since last read
+
+// PS2 control line timing, the line masks are defined by the target
+#define     PS2_INHIBIT_US  100         // Clock inhibit before a transmit, _delay_us() scales with F_CPU
+
+// Set to 1 to translate set 1 scan codes in PCINT0_vect straight into the key code output buffer,
+// the PS2 input buffer then only carries command replies and the modes the ISR does not handle
+#ifndef ISR_XLATE
+#define     ISR_XLATE       0
+#endif
+
+/* SRAM arena partitioning. All buffers and the statistics live in one static
+ * arena checked against ARENA_SIZE at compile time, the rest of the SRAM
+ * is left for the other variables (~110 bytes) and the stack.
+ * ARENA_SIZE and the buffer sizes are set by the target, 256 bytes of the ATtiny85's
+ * 512 byte SRAM, and 1024 bytes of the ATmega328P's 2048 byte SRAM.
+ * Buffer sizes must be a power of 2 and not larger than 128.
+ *   PS2 input buffer       2 bytes per entry, scan code and time
+ *   Key code output buffer 1 byte per entry, 2 with INSTRUMENT
+ *   Statistics             sizeof(stats_t) with INSTRUMENT
+ *   Trace buffer           3 bytes per entry, 0 entries removes trace capture
+ * The keyboard sends a byte at most every ~1mSec and main() takes one per pass,
+ * so the input buffer is small and the space goes to the output buffer, which
+ * has to absorb typing bursts while the host is busy.
+ */
+#define     PS2_BUFF_MASK   (PS2_BUFF_SIZE - 1)
+#define     KEY_BUFF_MASK   (KEY_BUFF_SIZE - 1)
+#define     TRACE_BUFF_MASK (TRACE_BUFF_SIZE - 1)
 
-// Pin change interrupt setting
-#define     GIMSK_INIT      0x20        // Enable pin change sensing on PB
-#define     PCMSK_INIT      0b00001000  // Enable pin change interrupt on PB3
-#define     PCINT_PB3       PCMSK_INIT  // Pin change interrupt on PB3
+// Trace entry types, first byte of each entry
+#define     TRACE_RX        0x00        // Byte received from the keyboard
+#define     TRACE_TX        0x01        // Byte sent to the keyboard
+#define     TRACE_ERR       0x02        // Receive error or incomplete frame, data is the ps2_state_t
+#define     TRACE_MAX_BURST 85          // Entries per SPI_CMD_TRACE, count byte is 3 * entries
 
-// USI
-#define     USICR_INIT      0b01011000  // 3-wire, external clock, positive edge, interrupts enabled
-#define     USICR_USIOIE    0b01000000  // Counter Overflow Interrupt Enable
+#if ( (PS2_BUFF_SIZE & PS2_BUFF_MASK) != 0 || PS2_BUFF_SIZE > 128 )
+#error "PS2_BUFF_SIZE must be a power of 2 no larger than 128"
+#endif
 
-#define     USI_CNTR_OVRF   0b01000000  // Counter overflow
-#define     USI_COUNTER     0b00001111  // USI mask counter bits
+#if ( (KEY_BUFF_SIZE & KEY_BUFF_MASK) != 0 || KEY_BUFF_SIZE > 128 )
+#error "KEY_BUFF_SIZE must be a power of 2 no larger than 128"
+#endif
 
-// PS2 control line masks
-#define     PS2_CLOCK       0b00001000
-#define     PS2_DATA        0b00010000
+#if ( (TRACE_BUFF_SIZE & TRACE_BUFF_MASK) != 0 || TRACE_BUFF_SIZE > 128 )
+#error "TRACE_BUFF_SIZE must be 0 or a power of 2 no larger than 128"
+#endif
 
-// Buffers
-#define     PS2_BUFF_SIZE   32          // PS2 input buffer
-#define     KEY_BUFF_SIZE   32          // Key code output buffer
+#if ( PS2_BUFF_SIZE < 4 || KEY_BUFF_SIZE < 4 )
+#error "PS2_BUFF_SIZE and KEY_BUFF_SIZE must hold at least a command reply and a key code frame"
+#endif
 
 // Host to Keyboard commands
 #define     PS2_HK_LEDS     0xED        // Set Status Indicators, next byte LED bit mask
@@ -129,9 +264,45 @@
 #define     PS2_KH_ERR1     0xFF        // Key Detection Error/Overrun (Code Set 1)
 
 #define     PS2_SCAN_CAPS   0x3a        // Caps lock scan code
+#define     PS2_SCAN_LSHIFT 0x2a        // Left shift scan code, its break code is PS2_KH_BATOK
 #define     PS2_SCAN_SCROLL 0x46        // Scroll lock scan code
 #define     PS2_SCAN_NUM    0x45        // Num lock scan code
 #define     PS2_LAST_CODE   0x50        // Last (largest scan code)
+#define     PS2_SET2_LAST   0x84        // Last set 2 scan code with a set 1 equivalent
+
+// Scan code set replies to PS2_HK_ALTCODE 0x00, untranslated and 8042 translated values
+#define     PS2_SET1_ID     0x01
+#define     PS2_SET1_XID    0x43
+#define     PS2_SET2_ID     0x02
+#define     PS2_SET2_XID    0x41
+#define     PS2_SET3_ID     0x03
+#define     PS2_SET3_XID    0x3f
+
+// Keyboard start-up
+#define     KBD_LED_TEST    0           // Set to 1 to run the LED light show at start-up
+#define     KBD_BAT_TIMEOUT 1000        // mSec to wait for keyboard BAT completion
+
+// Watchdog, armed after start-up and reset on every main loop pass
+#define     WDT_TIMEOUT     WDTO_60MS
+#define     MCUSR_WDRF      0b00001000  // Watchdog reset flag
+
+// Keyboard command queue
+#define     KBD_CMD_QUEUE   4           // Command queue depth, must be a power of 2
+#define     KBD_CMD_MASK    (KBD_CMD_QUEUE - 1)
+#define     KBD_CMD_TIMEOUT 30          // mSec to wait for a command byte's reply
+#define     KBD_CMD_RETRIES 3           // Resend attempts before a command is dropped
+
+#if ( (KBD_CMD_QUEUE & KBD_CMD_MASK) != 0 )
+#error "KBD_CMD_QUEUE must be a power of 2"
+#endif
+
+// PS2 receiver recovery
+#define     PS2_RX_TIMEOUT  2           // mSec without a clock edge before an incomplete frame is dropped
+
+// Host to keyboard transmit status
+#define     PS2_TX_OK       0           // Frame sent and acknowledged by keyboard
+#define     PS2_TX_ERR      -1          // Keyboard did not acknowledge the frame
+#define     PS2_TX_BUSY     1           // Frame transmit in progress
 
 /****************************************************************************
   Types
@@ -148,6 +319,85 @@ typedef enum
     PS2_RX_ERR_STOP,
 } ps2_state_t;
 
+typedef enum
+{
+    PS2_TX_IDLE,        // Transmitter idle, clock edges belong to the receiver
+    PS2_TX_INHIBIT,     // Host is holding the clock line low
+    PS2_TX_DATA,        // Clocking out data, parity and stop bits
+    PS2_TX_ACK,         // Waiting for keyboard's ACK bit
+} ps2_tx_state_t;
+
+typedef enum
+{
+    KBD_CMD_IDLE,       // No command in progress
+    KBD_CMD_SEND,       // Command or data byte being transmitted
+    KBD_CMD_REPLY,      // Waiting for keyboard's ACK or RESEND reply
+    KBD_CMD_RESPONSE,   // Waiting for the response byte that follows the last ACK
+} kbd_cmd_state_t;
+
+typedef enum
+{
+    SCAN_DEC_IDLE,      // Expecting a scan code or a prefix
+    SCAN_DEC_E0,        // 'E0' received, next byte is an extended key
+    SCAN_DEC_E1,        // 'E1' received, Pause/Break sequence
+    SCAN_DEC_E1_DROP,   // Discard last byte of an 'E1' sequence
+} scan_dec_state_t;
+
+typedef enum
+{
+    KBD_HP_IDLE,        // No keyboard re-initialization in progress
+    KBD_HP_PROBE,       // Possible BAT code in set 1, querying the keyboard's scan code set
+    KBD_HP_VERIFY,      // Set 1 requested after a re-plug, querying the resulting set
+} kbd_hotplug_t;
+
+typedef struct
+{
+    uint8_t  pcint_max;             // PCINT0_vect cycles, maximum
+    uint8_t  pcint_avg;             //   and running average
+    uint8_t  usi_max;               // USI_OVF_vect cycles, maximum
+    uint8_t  usi_avg;               //   and running average
+    uint8_t  ps2_peak;              // Peak 'ps2_scan_codes[]' occupancy
+    uint8_t  key_peak;              // Peak 'key_codes[]' occupancy
+    uint16_t rx_hist[STATS_BINS];   // Stop bit to 'key_codes[]' latency histogram
+    uint16_t tx_hist[STATS_BINS];   // 'key_codes[]' to SPI latency histogram
+    uint8_t  wake_max;              // Idle sleep wake-up to ISR body cycles, maximum
+    uint8_t  wake_avg;              //   and running average
+} stats_t;
+
+typedef struct
+{
+    uint8_t start;      // Invalid start bit
+    uint8_t parity;     // Parity errors
+    uint8_t stop;       // Invalid stop bit
+    uint8_t overrun;    // PS2 input buffer full
+    uint8_t timeout;    // Incomplete frames
+    uint8_t resend;     // RESEND commands sent to the keyboard
+} ps2_errors_t;
+
+typedef struct
+{
+    uint8_t  ps2_scan_codes[PS2_BUFF_SIZE];
+    uint8_t  ps2_scan_times[PS2_BUFF_SIZE];     // 1mSec tick at stop bit of each scan code
+    uint8_t  key_codes[KEY_BUFF_SIZE];
+#if ( INSTRUMENT )
+    uint8_t  key_times[KEY_BUFF_SIZE];          // 1mSec tick when written to 'key_codes[]'
+    stats_t  stats;                             // Read by the host with SPI_CMD_STATS
+#endif
+#if ( TRACE_BUFF_SIZE )
+    uint8_t  trace_type[TRACE_BUFF_SIZE];       // TRACE_* entry type
+    uint8_t  trace_data[TRACE_BUFF_SIZE];       // Byte or receiver error state
+    uint8_t  trace_time[TRACE_BUFF_SIZE];       // 1mSec tick
+#endif
+} arena_t;
+
+typedef struct
+{
+    uint8_t command;    // Command byte
+    uint8_t data;       // Optional data byte sent after command is ACKed
+    uint8_t length;     // 1 command only, 2 command and data byte
+    uint8_t response;   // 1 if the keyboard sends a response byte after the last ACK
+} kbd_cmd_t;
+
 typedef enum
 {
     I2C_IDLE,           // Idle
@@ -164,47 +414,509 @@ typedef enum
 ****************************************************************************/
 void    reset(void) __attribute__((naked)) __attribute__((section(".init3")));
 void    ioinit(void);
-
-int     ps2_send(uint8_t);
-int     ps2_recv_x(void);       // Blocking
+void    kbd_init(void);
+void    kbd_process(void);
+int     kbd_idle(void);
+int     kbd_tick_idle(void);
+
+int     ps2_send(uint8_t);      // Non-blocking
+int     ps2_send_status(void);
+void    ps2_send_cancel(void);
 int     ps2_recv(void);         // Non-blocking
 
 void    kbd_test_led(void);
+int     kbd_ready_wait(void);
 int     kdb_led_ctrl(uint8_t);
 int     kbd_code_set(int);
+int     kbd_code_set_query(void);
+int     kbd_hotplug_bat(int);
+void    kbd_hotplug_query(kbd_hotplug_t);
+void    kbd_hotplug_service(void);
+void    kbd_hotplug_reinit(void);
+void    kbd_raw_track(uint8_t);
 int     kbd_typematic_set(uint8_t);
 
-int     read_key(void);
+int     kbd_command(uint8_t, int, uint8_t);
+int     kbd_service(int);
+int     kbd_response_match(uint8_t, uint8_t);
+void    kbd_cmd_send(void);
+void    kbd_cmd_retry_send(void);
+void    kbd_wait(void);
+uint8_t timer_ms(void);
+
+uint8_t kbd_translate(uint8_t);
+void    kbd_isr_xlate_update(void);
+void    kbd_isr_translate(uint8_t);
+int     kbd_set2_convert(int);
+
+void    key_stage(void);
 int     write_key(uint8_t key_code);
+int     write_key_frame(uint8_t *frame, uint8_t length);
+int     key_write(uint8_t key_code, uint8_t time_delta);
+int     key_evict_make(void);
+void    key_output(uint8_t key_code);
+void    key_map_update(uint8_t key_code);
+int     key_map_held(uint8_t key_code);
+void    key_repeat_update(uint8_t key_code);
+int     key_repeat_due(void);
+uint8_t key_encode(uint8_t key_code);
+uint8_t key_matrix(uint8_t key_code, uint8_t layout);
+
+void    spi_status_update(void);
+
+#if ( INSTRUMENT )
+void    stats_clear(void);
+#endif
 
 /****************************************************************************
   Globals
 ****************************************************************************/
-// Circular buffer holding PS2 scan codes
-uint8_t      ps2_scan_codes[PS2_BUFF_SIZE];
-int          ps2_buffer_out = 0;
-volatile int ps2_buffer_in = 0;
-volatile int ps2_scan_code_count = 0;
+/* Circular buffers are single-producer/single-consumer rings.
+ * The 'in' index is only written by the producer and the 'out' index only
+ * by the consumer. Indices are free running 8-bit counters that are masked
+ * when used for access, so the ring holds (in - out) bytes without a shared
+ * count variable and every index access is a single atomic byte operation.
+ */
+
+// Static SRAM arena holding the PS2 input, key code and trace buffers and the statistics, see ARENA_SIZE
+volatile arena_t arena;
+
+_Static_assert(sizeof(arena_t) <= ARENA_SIZE, "Buffers and statistics exceed ARENA_SIZE");
+#if ( INSTRUMENT )
+_Static_assert(sizeof(stats_t) == 40, "Statistics layout changed, update PS2SPI_STATS_SIZE in rpi/ps2spi_host.h");
+#endif
+
+#define     ps2_scan_codes  (arena.ps2_scan_codes)
+#define     ps2_scan_times  (arena.ps2_scan_times)
+#define     key_codes       (arena.key_codes)
+#if ( INSTRUMENT )
+#define     key_times       (arena.key_times)
+#define     stats           (arena.stats)
+#endif
+#if ( TRACE_BUFF_SIZE )
+#define     trace_type      (arena.trace_type)
+#define     trace_data      (arena.trace_data)
+#define     trace_time      (arena.trace_time)
+#endif
+
+volatile uint8_t ps2_buffer_out = 0;
+volatile uint8_t ps2_buffer_in = 0;
+uint8_t          ps2_recv_time = 0;                 // Tick of the last scan code from ps2_recv()
+volatile uint8_t ps2_isr_xlate = 0;                 // PCINT0_vect translates received bytes, main() -> PCINT0_vect
 
 // Variable maintaining state of bit stream from PS2
-volatile ps2_state_t ps2_rx_state = PS2_IDLE;
-volatile uint8_t  ps2_rx_data_byte = 0;
-volatile int      ps2_rx_bit_count = 0;
-volatile int      ps2_rx_parity = 0;
+// Receiver state, shift register and bit count are held in the
+// GPIOR registers, where every load and store is a single cycle IN/OUT.
+// Bit operations are a single SBI/CBI on the ATtiny85, but only on GPIOR0 of
+// the ATmega328P, so GPIOR1 and GPIOR2 are only modified in PCINT0_vect
+#define     ps2_rx_state        GPIOR0      // ps2_state_t
+#define     ps2_rx_shift        GPIOR1      // Data byte shift register, LSB first
+#define     ps2_rx_count        GPIOR2      // b0..b3 bit count, b7 parity
+#define     PS2_RX_BITS         0x0f
+#define     PS2_RX_PARITY       0x80
+#define     PS2_RX_STOP_BIT     10          // Bit count on the stop bit edge, the 11th falling edge
+volatile uint8_t  ps2_rx_time = 0;          // Tick of the last receive clock edge
+volatile uint8_t  ps2_rx_resend = 0;        // Receive error requires a RESEND to the keyboard
+
+// PS2 error counters, saturate at 255, read by the host with SPI_CMD_ERRORS
+volatile ps2_errors_t ps2_errors;
+volatile uint8_t  spi_errors_clear = 0;
+
+#define     ERROR_COUNT(counter) \
+    { \
+        if ( ps2_errors.counter != 0xff ) \
+            ps2_errors.counter++; \
+    }
+
+/* End a received frame with an error on its stop bit edge: trace and count the error,
+ * request a RESEND for a parity or stop bit error before the keyboard sends
+ * its next frame, and return the receiver to idle
+ */
+#define     PS2_RX_ERROR(state, counter, resend) \
+    { \
+        TRACE_PUT(TRACE_ERR, (state)); \
+        ERROR_COUNT(counter); \
+        if ( resend ) \
+            ps2_rx_resend = 1; \
+        ps2_rx_state = PS2_IDLE; \
+    }
 
-// Key code output buffer
-uint8_t      key_codes[KEY_BUFF_SIZE];
-volatile int key_code_count = 0; //KEY_BUFF_SIZE;
-volatile int key_buffer_out = 0;
-volatile int key_buffer_in = 0;
+// Variables maintaining state of bit stream to PS2
+volatile ps2_tx_state_t ps2_tx_state = PS2_TX_IDLE;
+volatile int8_t   ps2_tx_result = PS2_TX_OK;
+volatile uint8_t  ps2_tx_data_byte = 0;
+volatile uint8_t  ps2_tx_bit_count = 0;
+volatile uint8_t  ps2_tx_parity = 0;
+
+// Key code output buffer, main() -> USI_OVF_vect
+volatile uint8_t key_buffer_out = 0;
+volatile uint8_t key_buffer_in = 0;
+
+/* Next key code staged for USI_OVF_vect, so that a poll or burst byte costs
+ * the ISR a single store to SPI_DATA. 'spi_key_next' is 0 when nothing is staged.
+ * Refilled by main(), and by USI_OVF_vect after each poll or burst byte it empties.
+ */
+volatile uint8_t spi_key_next = 0;
+volatile uint8_t spi_key_staged = 0;
+volatile uint8_t spi_key_phase = 0;         // Byte position in the key code frame of the next byte to stage
+volatile uint8_t spi_key_seq = 0;           // Staged byte is an OUT_MODE_SEQ sequence byte
+#if ( INSTRUMENT )
+volatile uint8_t spi_key_time = 0;          // 'key_times[]' entry of the staged key code
+#endif
+#ifdef SPI_SS_vect
+/* Key code byte handed out to SPI_DATA. SPI_SS_vect puts it back when SS rises
+ * before it was clocked out, and the next poll or burst byte returns it ahead of 'spi_key_next'.
+ */
+volatile uint8_t spi_key_sent = 0;
+volatile uint8_t spi_key_loaded = 0;        // 'spi_key_sent' is in SPI_DATA, cleared when it is clocked out
+volatile uint8_t spi_key_back = 0;          // 'spi_key_sent' was put back by SPI_SS_vect
+#endif
 
 volatile uint8_t command_in = 0;
+volatile uint8_t spi_burst_count = 0;
+volatile uint8_t spi_cmd_pending = 0;       // Command waiting for its data byte
+volatile uint8_t spi_flush = 0;             // Host requested a flush of PS2 input
+volatile uint8_t spi_idle = 0;              // SPI_DATA holds the idle response
+volatile uint8_t output_mode = OUT_MODE_XLATE;
+volatile uint8_t *spi_burst_data = 0;       // Burst source, 0 for key codes
+
+// Keyboard command queue and command engine state, main() only
+kbd_cmd_t       kbd_cmd_queue[KBD_CMD_QUEUE];
+uint8_t         kbd_cmd_in = 0;
+uint8_t         kbd_cmd_out = 0;
+kbd_cmd_state_t kbd_cmd_state = KBD_CMD_IDLE;
+uint8_t         kbd_cmd_byte = 0;
+uint8_t         kbd_cmd_retry = 0;
+uint8_t         kbd_cmd_timer = 0;
+int             kbd_cmd_result = PS2_KH_ACK;
+uint8_t         kbd_cmd_response = 0;
+
+// Active keyboard scan code set 1 or 2, set by kbd_init()
+volatile uint8_t kbd_scan_set = 1;
+
+// Time of last key code written to the output buffer, main() only
+uint8_t         key_time = 0;
+uint8_t         key_time_saturated = 1;
+
+// Pressed-key bitmap, bit 'n' of byte 'k' is key code (k * 8 + n), main() -> USI_OVF_vect
+volatile uint8_t key_map[KEY_MAP_SIZE];
+
+// AVR generated key repeat
+volatile uint8_t key_repeat_rate = 0;       // KEY_REP_* encoding from the host, 0 off
+uint8_t          key_repeat_code = 0;       // Translated key code to repeat, 0 none
+uint16_t         key_repeat_wait = 0;       // mSec to the next repeat
+uint8_t          key_repeat_tick = 0;       // Tick of the last 'key_repeat_wait' update
+
+// Key code output buffer overflow handling
+volatile uint8_t key_overflow = 0;          // Sticky, cleared when read by the host
+uint8_t          key_all_up_pending = 0;    // KEY_ALL_UP marker waiting for buffer space
+uint8_t          key_seq = 0;               // Sequence number of the next key code, counts lost codes too
+
+// Scan code prefix decoder state, main() only
+scan_dec_state_t scan_dec_state = SCAN_DEC_IDLE;
+uint8_t          scan_set2_break = 0;       // Set 2 'F0' break prefix received
+
+// Keyboard re-plug detection and re-initialization, main() only
+kbd_hotplug_t    kbd_hotplug_state = KBD_HP_IDLE;
+uint8_t          kbd_hotplug_cmd = 0;       // Command queue index of the scan code set query
+uint8_t          kbd_raw_lshift = 0;        // Left shift down, tracked in the raw output mode
+uint8_t          kbd_raw_prefix = 0;        // Last raw byte was an E0 or E1 prefix
+
+// MCUSR at reset, saved by reset() before .bss initialization
+volatile uint8_t reset_flags __attribute__((section(".noinit")));
+
+// System tick, incremented every 1mSec by Timer0
+volatile uint8_t timer_ticks = 0;
 
 // Variables maintaining state of I2C (USI in TWI mode)
 volatile i2c_state_t    i2c_state = I2C_IDLE;
 
+#if ( INSTRUMENT )
+// Statistics in the arena, read by the host with SPI_CMD_STATS
+uint16_t         stats_pcint_acc = 0;       // Running average accumulators, ISR only
+uint16_t         stats_usi_acc = 0;
+uint16_t         stats_wake_acc = 0;
+uint8_t          stats_wake_sleeps = 0;     // Idle sleeps since the last wake-up probe, main() only
+volatile uint8_t spi_stats_clear = 0;
+
+/* Measure ISR body cycles with the free running HAL_CYCLES timer, ISR prologue and epilogue
+ * are not included. Maximum is 255 cycles.
+ * Latency histogram bins are powers of 2: 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63 and 64+ mSec,
+ * found in line so that the ISRs make no function calls.
+ */
+#define     STATS_ISR_START()   uint8_t stats_isr_start = HAL_CYCLES
+#define     STATS_ISR_END(max, avg, acc) \
+    { \
+        uint8_t cycles = HAL_CYCLES - stats_isr_start; \
+        if ( cycles > stats.max ) \
+            stats.max = cycles; \
+        acc = acc - (acc >> STATS_AVG_SHIFT) + cycles; \
+        stats.avg = acc >> STATS_AVG_SHIFT; \
+    }
+#define     STATS_HIST(hist, msec) \
+    { \
+        uint8_t bin_msec = (msec); \
+        uint8_t bin = 0; \
+        while ( bin_msec ) \
+        { \
+            bin_msec = bin_msec >> 1; \
+            bin++; \
+        } \
+        if ( bin > (STATS_BINS - 1) ) \
+            bin = STATS_BINS - 1; \
+        if ( stats.hist[bin] != 0xffff ) \
+            stats.hist[bin]++; \
+    }
+#define     STATS_PEAK(peak, depth) \
+    { \
+        if ( (depth) > stats.peak ) \
+            stats.peak = (depth); \
+    }
+#define     STATS_STAGE(out)    { spi_key_time = key_times[(out) & KEY_BUFF_MASK]; }
+
+/* Every WAKE_PROBE_RATE idle sleeps main() arms a compare match on the HAL_CYCLES timer
+ * WAKE_PROBE_LEAD cycles ahead, which falls after SLEEP. WAKE_PROBE_vect
+ * then measures the cycles from the match to its body.
+ */
+#define     STATS_WAKE_ARM() \
+    { \
+        if ( ++stats_wake_sleeps >= WAKE_PROBE_RATE ) \
+        { \
+            stats_wake_sleeps = 0; \
+            HAL_WAKE_ARM(WAKE_PROBE_LEAD); \
+        } \
+    }
+#define     STATS_WAKE_DISARM() HAL_WAKE_DISARM()
+#else
+#define     STATS_ISR_START()
+#define     STATS_ISR_END(max, avg, acc)
+#define     STATS_HIST(hist, msec)
+#define     STATS_PEAK(peak, depth)
+#define     STATS_STAGE(out)
+#define     STATS_WAKE_ARM()
+#define     STATS_WAKE_DISARM()
+#endif
+
+#if ( TRACE_BUFF_SIZE )
+// Raw PS2 trace in the arena, written by the ISRs and ps2_send() -> USI_OVF_vect
+volatile uint8_t trace_on = 0;              // Capture enabled by SPI_CMD_TRCCTL
+volatile uint8_t trace_in = 0;
+volatile uint8_t trace_out = 0;
+volatile uint8_t trace_overflow = 0;        // Sticky, cleared when read by the host
+volatile uint8_t trace_phase = 0;           // Byte of the entry at 'trace_out' to send next
+#ifdef SPI_SS_vect
+volatile uint8_t trace_sent = 0;            // Last byte of the entry at 'trace_out' is in SPI_DATA
+#endif
+volatile uint8_t spi_burst_trace = 0;       // Burst source is the trace buffer
+
+/* Append an entry to the trace buffer while capture is enabled,
+ * a full buffer drops the entry. Callers outside an ISR must disable interrupts.
+ */
+#define     TRACE_PUT(type, data) \
+    { \
+        if ( trace_on ) \
+        { \
+            uint8_t trace_i = trace_in; \
+            if ( (uint8_t)(trace_i - trace_out) < TRACE_BUFF_SIZE ) \
+            { \
+                trace_type[trace_i & TRACE_BUFF_MASK] = (type); \
+                trace_data[trace_i & TRACE_BUFF_MASK] = (data); \
+                trace_time[trace_i & TRACE_BUFF_MASK] = timer_ticks; \
+                trace_in = trace_i + 1; \
+            } \
+            else \
+                trace_overflow = 1; \
+        } \
+    }
+#else
+#define     TRACE_PUT(type, data)
+#endif
+
+/* Bytes written to the keyboard output buffer for each key code in the selected
+ * output mode: the key code, then the time delta in OUT_MODE_TIME, then the
+ * sequence byte in OUT_MODE_SEQ, 1 to 3 bytes
+ */
+#define     KEY_FRAME_LENGTH() \
+    (1 + (( output_mode & OUT_MODE_TIME ) ? 1 : 0) + (( output_mode & OUT_MODE_SEQ ) ? 1 : 0))
+
+/* Move the next key code from the keyboard output buffer into the 'spi_key_next'
+ * holding register if it is empty, see key_stage(). Expanded in USI_OVF_vect
+ * so that restaging after a poll or burst byte makes no function call.
+ * Callers outside an ISR must disable interrupts.
+ */
+#define     KEY_STAGE() \
+    { \
+        uint8_t stage_out = key_buffer_out; \
+        if ( !spi_key_staged && key_buffer_in != stage_out ) \
+        { \
+            STATS_STAGE(stage_out); \
+            spi_key_next = key_codes[stage_out & KEY_BUFF_MASK]; \
+            key_buffer_out = ++stage_out; \
+            spi_key_staged = 1; \
+            spi_key_seq = 0; \
+            if ( ++spi_key_phase >= KEY_FRAME_LENGTH() ) \
+            { \
+                spi_key_seq = ( output_mode & OUT_MODE_SEQ ) ? 1 : 0; \
+                spi_key_phase = 0; \
+            } \
+        } \
+        if ( spi_key_seq && key_buffer_in != stage_out ) \
+            spi_key_next |= KEY_SEQ_MORE; \
+    }
+
+/* Hand the staged key code out to SPI_DATA for a poll or burst byte, or 0 if none
+ * is staged, and restage the next one. On targets with SPI_SS_vect a key code
+ * put back by SPI_SS_vect goes first, and the one handed out is kept until it is clocked.
+ * KEY_PENDING() counts the key codes not handed out yet.
+ */
+#ifdef SPI_SS_vect
+#define     KEY_PENDING() \
+    ((uint8_t)(key_buffer_in - key_buffer_out + spi_key_staged + spi_key_back))
+#define     KEY_HAND_OUT() \
+    { \
+        if ( spi_key_back ) \
+        { \
+            SPI_DATA = spi_key_sent; \
+            spi_key_back = 0; \
+            spi_key_loaded = 1; \
+        } \
+        else \
+        { \
+            uint8_t hand_out = spi_key_next; \
+            SPI_DATA = hand_out; \
+            spi_key_next = 0; \
+            spi_key_seq = 0; \
+            if ( spi_key_staged ) \
+            { \
+                STATS_HIST(tx_hist, timer_ticks - spi_key_time); \
+                spi_key_staged = 0; \
+                spi_key_sent = hand_out; \
+                spi_key_loaded = 1; \
+            } \
+            KEY_STAGE(); \
+        } \
+    }
+#else
+#define     KEY_PENDING() \
+    ((uint8_t)(key_buffer_in - key_buffer_out + spi_key_staged))
+#define     KEY_HAND_OUT() \
+    { \
+        SPI_DATA = spi_key_next; \
+        spi_key_next = 0; \
+        spi_key_seq = 0; \
+        if ( spi_key_staged ) \
+        { \
+            STATS_HIST(tx_hist, timer_ticks - spi_key_time); \
+            spi_key_staged = 0; \
+        } \
+        KEY_STAGE(); \
+    }
+#endif
+
+/* Load SPI_DATA with the byte returned to the host when there is no other response.
+ * In OUT_MODE_DRDY this is a status byte with the key code FIFO depth
+ * and a data pending bit, otherwise 0.
+ */
+#define     SPI_IDLE_LOAD() \
+    { \
+        uint8_t idle_depth = 0; \
+        if ( output_mode & OUT_MODE_DRDY ) \
+        { \
+            idle_depth = KEY_PENDING(); \
+            if ( idle_depth > SPI_STAT_DEPTH ) \
+                idle_depth = SPI_STAT_DEPTH; \
+            if ( idle_depth != 0 ) \
+                idle_depth |= SPI_STAT_PEND; \
+        } \
+        SPI_DATA = idle_depth; \
+    }
+
 // Keyboard status
-volatile uint8_t    kbd_lock_keys = 0;;
+volatile uint8_t    kbd_lock_keys = 0;
+volatile uint8_t    kbd_typematic = PS2_HK_TYPEMAT;
+uint8_t             kdb_lock_state = 0;             // LED state applied to the keyboard
+uint8_t             kbd_typematic_state = 0;        // Typematic setting applied to the keyboard
+
+/****************************************************************************
+  Scan code translation tables
+****************************************************************************/
+/* Tables are generated from the declarative keymap in KEYMAP.
+ * Each scan code is translated to the key code stored in 'key_codes[]'
+ * or to 0x00 if the code is discarded.
+ */
+#define     MTX(row, col)   (((row) << 4) | MATRIX_KEY | (col))
+#define     AUX(n)          ((((n) & 0x38) << 1) | ((n) & 0x07))
+
+// Set 1 scan code translation, make codes 0x00-0x7f break codes 0x80-0xff
+const uint8_t scan_code_xlate[256] PROGMEM =
+{
+#define     KEY(scan, key, dragon, coco)    [scan] = (key), [(scan) | 0x80] = ((key) | 0x80),
+#define     ALIAS(scan, key)                [scan] = (key), [(scan) | 0x80] = ((key) | 0x80),
+#define     KEY_E0(scan, key)
+#include    KEYMAP
+#undef      KEY
+#undef      ALIAS
+#undef      KEY_E0
+};
+
+// Set 1 scan code translation for codes following an 'E0' prefix
+const uint8_t scan_code_e0_xlate[256] PROGMEM =
+{
+#define     KEY(scan, key, dragon, coco)
+#define     ALIAS(scan, key)
+#define     KEY_E0(scan, key)               [scan] = (key), [(scan) | 0x80] = ((key) | 0x80),
+#include    KEYMAP
+#undef      KEY
+#undef      ALIAS
+#undef      KEY_E0
+};
+
+/* Set 2 make codes to set 1 make codes, the same conversion an 8042 controller
+ * applies. Codes without a set 1 equivalent convert to 0x00, which the set 1
+ * tables discard.
+ */
+const uint8_t scan_code_set2_xlate[PS2_SET2_LAST + 1] PROGMEM =
+{
+    0x00, 0x43, 0x41, 0x3f, 0x3d, 0x3b, 0x3c, 0x58, 0x64, 0x44, 0x42, 0x40, 0x3e, 0x0f, 0x29, 0x59,
+    0x65, 0x38, 0x2a, 0x70, 0x1d, 0x10, 0x02, 0x5a, 0x66, 0x71, 0x2c, 0x1f, 0x1e, 0x11, 0x03, 0x5b,
+    0x67, 0x2e, 0x2d, 0x20, 0x12, 0x05, 0x04, 0x5c, 0x68, 0x39, 0x2f, 0x21, 0x14, 0x13, 0x06, 0x5d,
+    0x69, 0x31, 0x30, 0x23, 0x22, 0x15, 0x07, 0x5e, 0x6a, 0x72, 0x32, 0x24, 0x16, 0x08, 0x09, 0x5f,
+    0x6b, 0x33, 0x25, 0x17, 0x18, 0x0b, 0x0a, 0x60, 0x6c, 0x34, 0x35, 0x26, 0x27, 0x19, 0x0c, 0x61,
+    0x6d, 0x73, 0x28, 0x74, 0x1a, 0x0d, 0x62, 0x6e, 0x3a, 0x36, 0x1c, 0x1b, 0x75, 0x2b, 0x63, 0x76,
+    0x55, 0x56, 0x77, 0x78, 0x79, 0x7a, 0x0e, 0x7b, 0x7c, 0x4f, 0x7d, 0x4b, 0x47, 0x7e, 0x7f, 0x6f,
+    0x52, 0x53, 0x50, 0x4c, 0x4d, 0x48, 0x01, 0x45, 0x57, 0x4e, 0x51, 0x4a, 0x37, 0x49, 0x46, 0x54,
+    0x00, 0x00, 0x00, 0x41, 0x54,
+};
+
+/* Translated set 1 key codes to Dragon keyboard matrix codes, or to 0x00 if the
+ * key has no matrix position. The break flag b7 is carried over from the key code.
+ *   b6..b4 PIA0 PA row, b3 = 1, b2..b0 PIA0 PB column
+ * Auxiliary keys, F2 to F10 for emulator functions, have b3 = 0 and
+ * the key number in b6..b4,b2..b0.
+ */
+const uint8_t key_matrix_xlate[MATRIX_LAYOUTS][PS2_LAST_CODE + 1] PROGMEM =
+{
+    // Dragon 32 and Dragon 64
+    {
+#define     KEY(scan, key, dragon, coco)    [key] = (dragon),
+#define     ALIAS(scan, key)
+#define     KEY_E0(scan, key)
+#include    KEYMAP
+#undef      KEY
+#undef      ALIAS
+#undef      KEY_E0
+    },
+    // Tandy CoCo
+    {
+#define     KEY(scan, key, dragon, coco)    [key] = (coco),
+#define     ALIAS(scan, key)
+#define     KEY_E0(scan, key)
+#include    KEYMAP
+#undef      KEY
+#undef      ALIAS
+#undef      KEY_E0
+    },
+};
 
 /* ----------------------------------------------------------------------------
  * main() control functions
@@ -212,138 +924,401 @@ volatile uint8_t    kbd_lock_keys = 0;;
  */
 int main(void)
 {
-    int     scan_code;
-    uint8_t kdb_lock_state = 0;
+#if ( IDLE_SLEEP && TICK_GATE )
+    uint8_t tick_stop;
+#endif
 
     // Initialize IO devices
     ioinit();
 
-    // Wait enough time for keyboard to complete self test
-    _delay_ms(1000);
+    // Interrupts are needed from here on to transmit to and receive from the keyboard
+    sei();
+
+    kbd_init();
+
+    /* The start-up waits are bounded by their own timeouts, and the LED test delays
+     * are longer than WDT_TIMEOUT, so the watchdog only guards the main loop.
+     * A watchdog reset comes back through kbd_ready_wait(), whose ECHO probe
+     * finds the running keyboard without waiting for a BAT code.
+     */
+    wdt_enable(WDT_TIMEOUT);
+
+    /* Loop forever. receive key strokes from the keyboard and
+     * accumulate them in a small FIFO buffer to be read by the emulation
+     * code running on the Raspberry Pi.
+     */
+    while ( 1 )
+    {
+        wdt_reset();
+
+        kbd_process();
+
+#if ( IDLE_SLEEP )
+        /* Sleep until the next interrupt if there is no work.
+         * The check runs with interrupts disabled and SEI executes the
+         * following SLEEP before any pending interrupt is serviced, so a scan code
+         * completed by PCINT0_vect after the check still wakes the loop.
+         * When nothing waits on the Timer0 tick it is stopped for the sleep, so only
+         * the keyboard and the host wake the AVR. The loop can then sleep for longer
+         * than WDT_TIMEOUT, and the watchdog is stopped with the tick.
+         */
+        cli();
+        if ( kbd_idle() )
+        {
+#if ( TICK_GATE )
+            tick_stop = kbd_tick_idle();
+            if ( tick_stop )
+            {
+                wdt_disable();
+                HAL_TICK_STOP();
+            }
+#endif
+            STATS_WAKE_ARM();
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+            cli();
+            STATS_WAKE_DISARM();
+#if ( TICK_GATE )
+            if ( tick_stop )
+            {
+                HAL_TICK_START();
+                wdt_enable(WDT_TIMEOUT);
+            }
+#endif
+        }
+        sei();
+#endif
+    }
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_init()
+ *
+ *  Wait for the keyboard and apply its start-up configuration.
+ *  Requires IO initialization and interrupts to be enabled.
+ *
+ *  param:  none
+ *  return: none
+ */
+void kbd_init(void)
+{
+    int     set_ack;
+
+    // Wait for keyboard to complete self test, or proceed on timeout
+    kbd_ready_wait();
 
+#if ( KBD_LED_TEST )
     // light LEDs in succession
     kbd_test_led();
+#endif
 
     // set typematic delay and rate
-    kbd_typematic_set(PS2_HK_TYPEMAT);
+    kbd_typematic_state = kbd_typematic;
+    kbd_typematic_set(kbd_typematic_state);
 
     // change code set to "1" so code set translation does not needs to take place on the AVR
     kbd_code_set(1);
+    kbd_wait();
+    set_ack = ( kbd_cmd_result == PS2_KH_ACK );
 
-    sei();
+    /* Some keyboards ignore or NAK the set change and stay in set 2,
+     * so read back the active set and decode set 2 on the AVR if needed.
+     * Without a reply assume set 1 if the change was ACKed, otherwise
+     * the power-on default set 2.
+     */
+    kbd_code_set_query();
+    kbd_wait();
 
-    /* Loop forever. receive key strokes from the keyboard and
-     * accumulate them in a small FIFO buffer to be read by the emulation
-     * code running on the Raspberry Pi.
+    if ( kbd_cmd_result == PS2_KH_ACK )
+    {
+        if ( kbd_cmd_response == PS2_SET1_ID || kbd_cmd_response == PS2_SET1_XID )
+        {
+            kbd_scan_set = 1;
+        }
+        else
+        {
+            // Set 3, or any other answer, is forced to set 2
+            if ( kbd_cmd_response != PS2_SET2_ID && kbd_cmd_response != PS2_SET2_XID )
+            {
+                kbd_code_set(2);
+                kbd_wait();
+            }
+            kbd_scan_set = 2;
+        }
+    }
+    else
+    {
+        kbd_scan_set = ( set_ack ) ? 1 : 2;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_process()
+ *
+ *  One pass of the main loop: service host requests, run the keyboard command engine,
+ *  and translate at most one scan code into the key code output buffer.
+ *  The function never blocks, so it can also be stepped by a host-native build
+ *  that calls the ISRs directly.
+ *
+ *  param:  none
+ *  return: none
+ */
+void kbd_process(void)
+{
+    int     scan_code;
+    uint8_t key_code;
+    uint8_t request;
+
+    kbd_hotplug_service();
+
+#if ( ISR_XLATE )
+    kbd_isr_xlate_update();
+#endif
+
+    /* Host flush command, the USI ISR already flushed 'key_codes[]'
      */
-    while ( 1 )
+    if ( spi_flush )
     {
-        scan_code = ps2_recv();
+        ps2_buffer_out = ps2_buffer_in;
+        scan_dec_state = SCAN_DEC_IDLE;
+        scan_set2_break = 0;
+        key_repeat_code = 0;
+        spi_flush = 0;
+    }
 
-        /* Only pass make and break codes for keys in range 1 to 83
-         * Handle 'E0' modifier for keypad by removing the 'E0' which
-         * will effectively reduce any keyboard to one that is equivalent to an 83 key keyboard.
-         * Discard PrtScrn E0,2A,E0,37 and E0,B7,E0,AA; no support print screen.
-         * Discard E1 sequence of Pause/Break
-         */
-        if  ( scan_code != -1 )
+    if ( spi_errors_clear )
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
         {
-            // Handle 'E1' scan code case for Pause/Break key
-            if ( scan_code == 0xe1 )
-            {
-                // Get the next byte
-                scan_code = ps2_recv_x();
+            ps2_errors.start = 0;
+            ps2_errors.parity = 0;
+            ps2_errors.stop = 0;
+            ps2_errors.overrun = 0;
+            ps2_errors.timeout = 0;
+            ps2_errors.resend = 0;
+        }
+        spi_errors_clear = 0;
+    }
 
-                // Get the next byte and discard sequence
-                if ( scan_code == 0x1d )
-                {
-                    ps2_recv_x();
-                    continue;
-                }
-                else if ( scan_code == 0x9d )
-                {
-                    ps2_recv_x();
-                    continue;
-                }
-            }
+    /* Request the keyboard to resend a byte received with an error.
+     * A command in progress recovers through its own reply timeout instead.
+     * The request stays pending while the transmitter is busy.
+     */
+    if ( ps2_rx_resend && kbd_cmd_state == KBD_CMD_IDLE )
+    {
+        if ( ps2_send(PS2_HK_RESEND) == 0 )
+        {
+            ERROR_COUNT(resend);
+            ps2_rx_resend = 0;
+        }
+    }
 
-            // Handle 'E0' scan code cases
-            if ( scan_code == 0xe0 )
+#if ( INSTRUMENT )
+    if ( spi_stats_clear )
+    {
+        stats_clear();
+        spi_stats_clear = 0;
+    }
+#endif
+
+    /* Run the keyboard command engine, which consumes
+     * command replies and passes through all other scan codes
+     */
+    scan_code = kbd_service(ps2_recv());
+
+    if ( scan_code == PS2_KH_BATOK )
+        scan_code = kbd_hotplug_bat(scan_code);
+
+    /* Convert set 2 to set 1 here so both sets share the translation below.
+     * Raw output passes the keyboard's set 2 bytes unchanged.
+     */
+    if ( kbd_scan_set == 2 && (output_mode & OUT_MODE_ENC) != OUT_MODE_RAW )
+        scan_code = kbd_set2_convert(scan_code);
+
+    /* Translate scan codes and store the resulting key codes
+     * in the key code output buffer 'key_codes[]'.
+     * Prefix sequences are decoded one byte per loop iteration.
+     */
+    if  ( scan_code != -1 )
+    {
+        if ( (output_mode & OUT_MODE_ENC) == OUT_MODE_RAW )
+        {
+            key_code = (uint8_t)scan_code;
+            if ( kbd_scan_set == 1 )
+                kbd_raw_track(key_code);
+        }
+        else
+            key_code = kbd_translate((uint8_t)scan_code);
+
+        if ( key_code != 0 && (output_mode & OUT_MODE_ENC) != OUT_MODE_RAW )
+        {
+            /* Drop typematic repeats of a key that is already down,
+             * also when the AVR generates the repeats itself
+             */
+            if ( ((output_mode & OUT_MODE_NOREP) || key_repeat_rate) && key_map_held(key_code) )
             {
-                // Get the next byte
-                scan_code = ps2_recv_x();
-
-                // Keep only wanted sequence pairs and discard the rest
-                if ( scan_code == 0x50 ||
-                     scan_code == 0xd0 ||
-                     scan_code == 0x4d ||
-                     scan_code == 0xcd ||
-                     scan_code == 0x4b ||
-                     scan_code == 0xcb ||
-                     scan_code == 0x48 ||
-                     scan_code == 0xc8    )
-                {
-                    // Do nothing. The 'keep'list is shorter then the 'discard' list
-                }
-                else
-                {
-                    continue;
-                }
+                key_code = 0;
             }
-
-            // Remove unwanted scan codes
-            switch ( scan_code & 0x7f )
+            else
             {
-                case 15:        // Tab
-                case 27:        // ]
-                case 29:        // L-Ctrl, R-Ctrl
-                case 41:        // '
-                case 40:        // ' and " signs
-                case 43:        // Back slash
-                case 55:        // Keypad *
-                case 56:        // Alt keys
-                case 58:        // Caps lock
-                case 69 ... 71: // Keypad
-                case 73 ... 74:
-                case 76:
-                case 78 ... 79:
-                case 81 ... 83:
-                case 85:        // Special keys
-                case 133:
-                case 134:
-                case 91 ... 93:
-                    continue;
-
-                case 54:
-                    scan_code = (scan_code & 0x80) + 42;
-                    break;
+                key_map_update(key_code);
+                key_repeat_update(key_code);
+                key_code = key_encode(key_code);
             }
+        }
 
-            if  ( ((uint8_t)scan_code & 0x7f) > PS2_LAST_CODE || scan_code == 0 )
+        if ( key_code != 0 )
+        {
+            key_output(key_code);
+
+#if ( INSTRUMENT )
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
             {
-                continue;
+                STATS_HIST(rx_hist, timer_ms() - ps2_recv_time);
             }
+#endif
 
-            /* Store processed scan code in the key code output buffer 'key_codes[]'
-             */
-            write_key(scan_code);
-
-            // TODO: Handle commands from the host Raspberry Pi
-            //       Test variable 'command_in'
+            if ( output_mode & OUT_MODE_DRDY )
+                spi_status_update();
         }
+    }
 
-        /* Update indicator LEDs if required
-         * do this only if there is no pending scan code in the buffer
-         * so that host-to-keyboard comm does not interfere with scan code exchange
-         */
-        else if ( kdb_lock_state != kbd_lock_keys )
+    /* Saturate the time delta of the next key code before the 8-bit tick wraps
+     */
+    else if ( !key_time_saturated && (uint8_t)(timer_ms() - key_time) > KEY_TIME_STALE )
+    {
+        key_time_saturated = 1;
+    }
+
+    /* A set 2 break prefix was consumed, its scan code follows
+     */
+    else if ( scan_set2_break )
+    {
+        /* hold keyboard commands until the break sequence completes */
+    }
+
+    /* Generate a repeat of the last key pressed, time stamped when generated
+     */
+    else if ( key_repeat_due() )
+    {
+        ps2_recv_time = timer_ms();
+        key_code = key_encode(key_repeat_code);
+
+        if ( key_code != 0 )
         {
-            kdb_led_ctrl(kbd_lock_keys);
-            kdb_lock_state = kbd_lock_keys;
+            key_output(key_code);
+
+            if ( output_mode & OUT_MODE_DRDY )
+                spi_status_update();
         }
     }
 
-    return 0;
+    /* Update indicator LEDs and typematic settings requested by the host.
+     * do this only if there is no pending scan code in the buffer
+     * so that host-to-keyboard comm does not interfere with scan code exchange
+     */
+    else if ( kdb_lock_state != (request = kbd_lock_keys) )
+    {
+        if ( kdb_led_ctrl(request) == 0 )
+            kdb_lock_state = request;
+    }
+    else if ( kbd_typematic_state != (request = kbd_typematic) )
+    {
+        if ( kbd_typematic_set(request) == 0 )
+            kbd_typematic_state = request;
+    }
+
+    // Keep the next key code staged for the host
+    key_stage();
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_idle()
+ *
+ *  Check if kbd_process() has no work that can proceed before the next interrupt.
+ *  Scan codes, keyboard replies and transmit completion are signaled by PCINT0_vect,
+ *  host commands by USI_OVF_vect, and command timeouts and key time saturation
+ *  are picked up on the Timer0 1mSec tick.
+ *
+ *  Idle sleep keeps the system clock running, so wake-up only extends
+ *  the interrupt response by 4 cycles, 0.5uSec at 8MHz or 0.25uSec at 16MHz. This is well inside
+ *  the shortest PS2 clock half period of 30uSec and the PCINT0_vect budget.
+ *  INSTRUMENT builds measure it with WAKE_PROBE_vect.
+ *
+ *  param:  none
+ *  return: 1 nothing to do, 0 work pending
+ */
+int kbd_idle(void)
+{
+    int     cmd_idle, cmd_room;
+
+    if ( ps2_buffer_in != ps2_buffer_out )
+        return 0;
+
+    if ( !spi_key_staged && key_buffer_in != key_buffer_out )
+        return 0;
+
+    if ( spi_flush || spi_errors_clear )
+        return 0;
+
+#if ( INSTRUMENT )
+    if ( spi_stats_clear )
+        return 0;
+#endif
+
+    cmd_idle = (kbd_cmd_state == KBD_CMD_IDLE);
+    cmd_room = ((uint8_t)(kbd_cmd_in - kbd_cmd_out) < KBD_CMD_QUEUE);
+
+    if ( cmd_idle && (ps2_rx_resend || kbd_cmd_in != kbd_cmd_out) )
+        return 0;
+
+    if ( cmd_room && (kdb_lock_state != kbd_lock_keys || kbd_typematic_state != kbd_typematic) )
+        return 0;
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_tick_idle()
+ *
+ *  Check if nothing waits on the Timer0 tick, so that main() can stop it for an idle sleep.
+ *  The receiver, transmitter and command processing have no timeout running, the
+ *  key time has saturated or OUT_MODE_TIME is off, no key repeats, no key code latency
+ *  is being measured and trace capture is off. Called after kbd_idle() with interrupts disabled.
+ *  'timer_ticks' does not advance while the tick is stopped, so the gated time is
+ *  not seen by the latency statistics, and the first time delta after OUT_MODE_TIME
+ *  is turned on can be short by the gated time.
+ *
+ *  param:  none
+ *  return: 1 the tick can stop, 0 a timeout, repeat or time stamp needs it
+ */
+int kbd_tick_idle(void)
+{
+    if ( ps2_rx_state != PS2_IDLE || ps2_tx_state != PS2_TX_IDLE )
+        return 0;
+
+    if ( kbd_cmd_state != KBD_CMD_IDLE )
+        return 0;
+
+    if ( !key_time_saturated && (output_mode & OUT_MODE_TIME) )
+        return 0;
+
+    if ( key_repeat_code && key_repeat_rate )
+        return 0;
+
+    if ( spi_key_staged || key_buffer_in != key_buffer_out )
+        return 0;
+
+#if ( TRACE_BUFF_SIZE )
+    if ( trace_on )
+        return 0;
+#endif
+
+    return 1;
 }
 
 /* ----------------------------------------------------------------------------
@@ -360,6 +1335,7 @@ void reset(void)
     // after a system reset (except a power-on condition), using the fastest
     // prescaler value (approximately 15 ms). It is therefore required
     // to turn off the watchdog early during program startup.
+    reset_flags = MCUSR;
     MCUSR = 0; // clear reset flags
     wdt_disable();
 }
@@ -368,149 +1344,128 @@ void reset(void)
  * ioinit()
  *
  *  Initialize IO interfaces.
- *  Timer and data rates calculated based on the default 8MHz internal clock.
+ *  Timer and data rates are calculated from F_CPU, 8MHz internal RC oscillator
+ *  or 16MHz PLL clock. The clock source is selected by the fuses, not here.
  *
  */
 void ioinit(void)
 {
-    // Reconfigure system clock scaler to 8MHz
+    // Reconfigure system clock scaler to 1, for 8MHz RC or 16MHz PLL clock
     CLKPR = 0x80;   // change clock scaler (sec 8.12.2 p.37)
     CLKPR = 0x00;
 
-    // Initialize general IO PB pins
-    DDRB  = PB_DDR_INIT;
-    PORTB = PB_INIT;
-    PORTB = PB_INIT | PB_PUP_INIT;
+    // Initialize IO pins, SPI slave and pin change interrupts
+    HAL_IO_INIT();
 
-    // Initialize USI for 3-Wire mode (SPI)
-    USISR &= ~USI_COUNTER;
-    USISR |= USI_CNTR_OVRF;
-    USIDR = 0;
-    USICR = USICR_INIT;
+#if ( IDLE_SLEEP )
+    // Idle sleep keeps the SPI slave, pin change interrupts and timers running
+    set_sleep_mode(SLEEP_MODE_IDLE);
+#endif
 
-    // Pin change interrupt setting
-    GIMSK = GIMSK_INIT;
-    PCMSK = PCMSK_INIT;
+    // Timer0 system tick
+    HAL_TICK_INIT();
+
+#if ( INSTRUMENT )
+    // Free running cycle counter
+    HAL_CYCLES_INIT();
+#endif
 }
 
 /* ----------------------------------------------------------------------------
  * ps2_send()
  *
- *  Send a command to the PS2 keyboard
+ *  Start sending a command byte to the PS2 keyboard.
+ *  The function only performs the request-to-send sequence,
+ *  the rest of the frame is clocked out by the PCINT0 ISR:
  *  1)   Bring the Clock line low for at least 100 microseconds.
  *  2)   Bring the Data line low.
  *  3)   Release the Clock line.
  *
- *  4)   Set/reset the Data line to send the first data bit
- *  5)   Wait for the device to bring Clock low.
- *  6)   Repeat steps 5-7 for the other seven data bits and the parity bit
- *  7)   Wait for the device to bring Clock high.
+ *  PCINT0 ISR, on each falling Clock edge generated by the keyboard:
+ *  4)   Set/reset the Data line to send the data bits, parity bit and stop bit
+ *  5)   Release the Data line after the stop bit.
+ *  6)   Sample the keyboard's ACK bit on the next falling Clock edge.
  *
- *  8)   Release the Data line.
- *  9)   Wait for the device to bring Data low.
- *  10)  Wait for the device to bring Clock  low.
- *  11)  Wait for the device to release Data and Clock
+ *  Transmit completion and the ACK bit state are reported by ps2_send_status().
+ *  The keyboard's reply byte (ACK 0xFA etc.) arrives in the PS2 input buffer.
  *
  *  param: command byte
- *  return: -1 transmit error, 0 ok
+ *  return: -1 transmitter busy, 0 ok frame transmit started
  */
 int ps2_send(uint8_t byte)
 {
-    int     ps2_tx_parity = 1;
-    int     ps2_tx_bit_count = 0;
-    uint8_t ps2_data_bit;
-    int     result;
+    if ( ps2_tx_state != PS2_TX_IDLE )
+        return -1;
 
-    // Disable pin-change interrupts and reset receiver state so receive ISR does not run
-    cli();
-    //PCMSK &= ~PCINT_PB3;
+    /* Claim the clock line from the receiver before driving it,
+     * the receive ISR ignores clock edges while a transmit is in progress
+     */
+    ps2_tx_state = PS2_TX_INHIBIT;
+    ps2_tx_result = PS2_TX_BUSY;
+    ps2_tx_data_byte = byte;
+    ps2_tx_bit_count = 0;
+    ps2_tx_parity = 1;
 
     ps2_rx_state = PS2_IDLE;
-    ps2_rx_data_byte = 0;
-    ps2_rx_bit_count = 0;
-    ps2_rx_parity = 0;
-
-    // Follow byte send steps
-    DDRB |= PS2_CLOCK;
-    PORTB &= ~PS2_CLOCK;
-    _delay_us(100);
-
-    DDRB |= PS2_DATA;
-    PORTB &= ~PS2_DATA;
 
-    DDRB &= ~PS2_CLOCK;
-    PORTB |= PS2_CLOCK;
-
-    while ( ps2_tx_bit_count < 10 )
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        // This will repeat 8 bits of data, one parity bit, and one stop bit for transmission
-        if ( ps2_tx_bit_count < 8 )
-        {
-            ps2_data_bit = byte & 0x01;
-            ps2_tx_parity += ps2_data_bit;
-        }
-        else if ( ps2_tx_bit_count == 8 )
-        {
-            ps2_data_bit = (uint8_t)ps2_tx_parity & 0x01;
-        }
-        else
-        {
-            ps2_data_bit = 1;
-        }
-
-        do {} while ( (PINB & PS2_CLOCK) );
-
-        if ( ps2_data_bit )
-            PORTB |= PS2_DATA;
-        else
-            PORTB &= ~PS2_DATA;
-
-        do {} while ( !(PINB & PS2_CLOCK) );
-
-        ps2_tx_bit_count++;
-        byte = byte >> 1;
+        TRACE_PUT(TRACE_TX, byte);
     }
 
-    // Restore data line to receive mode
-    DDRB &= ~PS2_DATA;
-    PORTB |= PS2_DATA;
-
-    // Check here for ACK pulse and line to idle
-    do {} while ( (PINB & PS2_CLOCK) );
-    result = -1 * (int)(PINB & PS2_DATA);
+    // Follow byte send steps
+    PS2_DDR |= PS2_CLOCK;
+    PS2_PORT &= ~PS2_CLOCK;
+    _delay_us(PS2_INHIBIT_US);
 
-    // Wait for clock to go high before enabling interrupts
-    do {} while ( !(PINB & PS2_CLOCK) );
+    PS2_DDR |= PS2_DATA;
+    PS2_PORT &= ~PS2_DATA;
 
-    sei();
-    //PCMSK |= PCINT_PB3;
+    ps2_tx_state = PS2_TX_DATA;
 
-    // Allow keyboard to recover before exiting,
-    // so that another ps2_send() is spaced in time from this call.
-    _delay_ms(20);
+    PS2_DDR &= ~PS2_CLOCK;
+    PS2_PORT |= PS2_CLOCK;
 
-    return result;
+    return 0;
 }
 
 /* ----------------------------------------------------------------------------
- * ps2_recv_x()
+ * ps2_send_status()
  *
- *  Get a byte from the PS2 input buffer and block until byte is available
+ *  Get the status of the last frame sent with ps2_send()
  *
  *  param:  none
- *  return: data byte value
+ *  return: PS2_TX_BUSY transmit in progress,
+ *          PS2_TX_OK frame acknowledged by keyboard, PS2_TX_ERR no ACK bit
  *
  */
-int ps2_recv_x(void)
+int ps2_send_status(void)
 {
-    int     result;
+    return (int)ps2_tx_result;
+}
 
-    do
-    {
-        result = ps2_recv();
-    } while ( result == -1 );
+/* ----------------------------------------------------------------------------
+ * ps2_send_cancel()
+ *
+ *  Abort a transmit that the keyboard did not clock out,
+ *  release the PS2 lines and return them to the receiver.
+ *
+ *  param:  none
+ *  return: none
+ *
+ */
+void ps2_send_cancel(void)
+{
+    cli();
 
-    return result;
+    PS2_DDR &= ~(PS2_CLOCK | PS2_DATA);
+    PS2_PORT |= (PS2_CLOCK | PS2_DATA);
+
+    ps2_tx_state = PS2_TX_IDLE;
+    ps2_tx_result = PS2_TX_ERR;
+    ps2_rx_state = PS2_IDLE;
+
+    sei();
 }
 
 /* ----------------------------------------------------------------------------
@@ -525,14 +1480,13 @@ int ps2_recv_x(void)
 int ps2_recv(void)
 {
     int     result = -1;
+    uint8_t out = ps2_buffer_out;
 
-    if ( ps2_scan_code_count > 0 )
+    if ( ps2_buffer_in != out )
     {
-        result = (int)ps2_scan_codes[ps2_buffer_out];
-        ps2_scan_code_count--;
-        ps2_buffer_out++;
-        if ( ps2_buffer_out == PS2_BUFF_SIZE )
-            ps2_buffer_out = 0;
+        result = (int)ps2_scan_codes[out & PS2_BUFF_MASK];
+        ps2_recv_time = ps2_scan_times[out & PS2_BUFF_MASK];
+        ps2_buffer_out = out + 1;
     }
 
     return result;
@@ -551,56 +1505,94 @@ int ps2_recv(void)
 void kbd_test_led(void)
 {
     kdb_led_ctrl(PS2_HK_SCRLOCK);
+    kbd_wait();
 
     _delay_ms(200);
 
     kdb_led_ctrl(0);
     kdb_led_ctrl(PS2_HK_CAPSLOCK);
+    kbd_wait();
 
     _delay_ms(200);
 
     kdb_led_ctrl(0);
     kdb_led_ctrl(PS2_HK_NUMLOCK);
+    kbd_wait();
 
     _delay_ms(200);
 
     kdb_led_ctrl(0);
     kdb_led_ctrl(PS2_HK_CAPSLOCK);
+    kbd_wait();
 
     _delay_ms(200);
 
     kdb_led_ctrl(0);
     kdb_led_ctrl(PS2_HK_SCRLOCK);
+    kbd_wait();
 
     _delay_ms(200);
 
     kdb_led_ctrl(0);
+    kbd_wait();
 }
 
 /* ----------------------------------------------------------------------------
- * kdb_led_ctrl()
+ * kbd_ready_wait()
  *
- *  Function for setting LED state to 'on' or 'off'
+ *  Wait for the keyboard to be ready to accept commands.
+ *  After a power-up the keyboard sends BAT completion code 0xAA when its
+ *  self test is done. When only the AVR was reset the keyboard is already
+ *  running and will not send a BAT code, so it is probed with an ECHO command
+ *  that a ready keyboard answers immediately.
  *
- *  param:  LED bits, b0=Scroll lock b1=Num lock b2=Caps Lock
- *  return: none
+ *  param:  none
+ *  return: 0 keyboard ready, -1 BAT failure or KBD_BAT_TIMEOUT expired
  */
-int kdb_led_ctrl(uint8_t state)
+int kbd_ready_wait(void)
 {
-    int temp_scan_code;
+    int      scan_code;
+    uint16_t elapsed = 0;
+    uint8_t  tick;
 
-    state &= 0x07;
+    ps2_send(PS2_HK_ECHO);
 
-    ps2_send(PS2_HK_LEDS);
-    temp_scan_code = ps2_recv_x();
+    tick = timer_ms();
 
-    if ( temp_scan_code == PS2_KH_ACK )
+    while ( elapsed < KBD_BAT_TIMEOUT )
     {
-        ps2_send(state);
-        temp_scan_code = ps2_recv_x();
+        scan_code = ps2_recv();
+
+        if ( scan_code == PS2_KH_BATOK || scan_code == PS2_KH_ECHO )
+            return 0;
+        else if ( scan_code == PS2_KH_ERR )
+            return -1;
+
+        // A keyboard in self test may not clock out the ECHO command
+        if ( elapsed > KBD_CMD_TIMEOUT && ps2_send_status() == PS2_TX_BUSY )
+            ps2_send_cancel();
+
+        if ( timer_ms() != tick )
+        {
+            tick++;
+            elapsed++;
+        }
     }
 
-    return temp_scan_code;
+    return -1;
+}
+
+/* ----------------------------------------------------------------------------
+ * kdb_led_ctrl()
+ *
+ *  Function for setting LED state to 'on' or 'off'
+ *
+ *  param:  LED bits, b0=Scroll lock b1=Num lock b2=Caps Lock
+ *  return: -1 command queue full, 0 command queued
+ */
+int kdb_led_ctrl(uint8_t state)
+{
+    return kbd_command(PS2_HK_LEDS, state & 0x07, 0);
 }
 
 /* ----------------------------------------------------------------------------
@@ -610,25 +1602,182 @@ int kdb_led_ctrl(uint8_t state)
  *  Legal values are 1, 2 or 3.
  *
  *  param:  scan code set identifier
- *  return: PS2_KH_ACK no errors, other keyboard response if error
+ *  return: -1 illegal set or command queue full, 0 command queued
  */
 int kbd_code_set(int set)
 {
-    int temp_scan_code;
-
     if ( set < 1 || set > 3 )
-        return PS2_KH_RESEND;
+        return -1;
+
+    return kbd_command(PS2_HK_ALTCODE, set, 0);
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_code_set_query()
+ *
+ *  The function requests the keyboard to report its active scan code set.
+ *  When the command completes with 'kbd_cmd_result' equal to ACK,
+ *  'kbd_cmd_response' holds the set: 1, 2 or 3, or 8042 translated 0x43, 0x41 or 0x3f.
+ *
+ *  param:  none
+ *  return: -1 command queue full, 0 command queued
+ */
+int kbd_code_set_query(void)
+{
+    return kbd_command(PS2_HK_ALTCODE, 0, 1);
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_hotplug_bat()
+ *
+ *  Handle a BAT completion code received in the main loop. A keyboard that is
+ *  plugged in again resets to scan code set 2 and default typematic and LEDs,
+ *  and sends a BAT code.
+ *  In set 2 the BAT code is unambiguous and the keyboard is re-initialized.
+ *  In set 1 0xAA is also the left shift break code, so when the prefix
+ *  decoder is idle and left shift is not down in the key map the keyboard
+ *  is asked for its scan code set, and kbd_hotplug_service() re-initializes
+ *  it if it reports set 2. The byte is still translated, as left shift
+ *  break it is harmless.
+ *  The key map is not updated in the raw output mode, where kbd_raw_track()
+ *  follows the prefix and left shift state instead.
+ *
+ *  param:  scan code PS2_KH_BATOK
+ *  return: -1 if the byte was consumed, otherwise the scan code
+ */
+int kbd_hotplug_bat(int scan_code)
+{
+    if ( kbd_hotplug_state != KBD_HP_IDLE )
+        return scan_code;
+
+    if ( kbd_scan_set == 2 )
+    {
+        kbd_hotplug_reinit();
+        return -1;
+    }
+
+    if ( (output_mode & OUT_MODE_ENC) == OUT_MODE_RAW )
+    {
+        if ( !kbd_raw_prefix && !kbd_raw_lshift )
+            kbd_hotplug_query(KBD_HP_PROBE);
+    }
+    else if ( scan_dec_state == SCAN_DEC_IDLE && !key_map_held(PS2_SCAN_LSHIFT) )
+    {
+        kbd_hotplug_query(KBD_HP_PROBE);
+    }
+
+    return scan_code;
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_hotplug_query()
+ *
+ *  Queue a scan code set query for the re-plug detection,
+ *  or return to idle if the command queue is full.
+ *
+ *  param:  state to wait for the query's completion in
+ *  return: none
+ */
+void kbd_hotplug_query(kbd_hotplug_t state)
+{
+    kbd_cmd_response = 0;
+    kbd_hotplug_cmd = kbd_cmd_in;
+
+    if ( kbd_code_set_query() == 0 )
+        kbd_hotplug_state = state;
+    else
+        kbd_hotplug_state = KBD_HP_IDLE;
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_hotplug_service()
+ *
+ *  Act on the completed scan code set query of the re-plug detection.
+ *  'kbd_cmd_response' stays 0 when the query failed.
+ *
+ *  param:  none
+ *  return: none
+ */
+void kbd_hotplug_service(void)
+{
+    uint8_t set2;
+
+    if ( kbd_hotplug_state == KBD_HP_IDLE ||
+         (int8_t)(kbd_cmd_out - kbd_hotplug_cmd) <= 0 )
+        return;
+
+    set2 = ( kbd_cmd_response == PS2_SET2_ID || kbd_cmd_response == PS2_SET2_XID );
+
+    if ( kbd_hotplug_state == KBD_HP_VERIFY )
+    {
+        kbd_scan_set = ( kbd_cmd_response == PS2_SET1_ID || kbd_cmd_response == PS2_SET1_XID ) ? 1 : 2;
+        kbd_hotplug_state = KBD_HP_IDLE;
+        return;
+    }
+
+    kbd_hotplug_state = KBD_HP_IDLE;
+
+    if ( set2 )
+        kbd_hotplug_reinit();
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_hotplug_reinit()
+ *
+ *  Re-initialize a re-plugged keyboard without the start-up BAT wait.
+ *  Keys held in the key map are released, the typematic and LED states are
+ *  marked as not applied so the main loop sends them again, and set 1 is
+ *  requested and then verified by kbd_hotplug_service().
+ *
+ *  param:  none
+ *  return: none
+ */
+void kbd_hotplug_reinit(void)
+{
+    uint8_t i;
+
+    for ( i = 0; i < KEY_MAP_SIZE; i++ )
+        key_map[i] = 0;
+    key_repeat_code = 0;
+    scan_dec_state = SCAN_DEC_IDLE;
+    scan_set2_break = 0;
+    kbd_raw_lshift = 0;
+    kbd_raw_prefix = 0;
+    if ( output_mode & OUT_MODE_KEYUP )
+        key_all_up_pending = 1;
 
-    ps2_send(PS2_HK_ALTCODE);
-    temp_scan_code = ps2_recv_x();
+    kbd_typematic_state = 0xff;
+    kdb_lock_state = 0xff;
+
+    kbd_code_set(1);
+    kbd_hotplug_query(KBD_HP_VERIFY);
+}
 
-    if ( temp_scan_code == PS2_KH_ACK )
+/* ----------------------------------------------------------------------------
+ * kbd_raw_track()
+ *
+ *  Follow left shift in the raw output mode for kbd_hotplug_bat(), which
+ *  cannot use the key map there. Called after the BAT check with every
+ *  set 1 byte passed to the host. 'E0 2A' and 'E0 AA' are the fake shifts
+ *  of the extended keys and do not change the state.
+ *
+ *  param:  scan code byte
+ *  return: none
+ */
+void kbd_raw_track(uint8_t scan_code)
+{
+    if ( kbd_raw_prefix )
     {
-        ps2_send((uint8_t)set);
-        temp_scan_code = ps2_recv_x();
+        kbd_raw_prefix = 0;
+        return;
     }
 
-    return temp_scan_code;
+    if ( scan_code == 0xe0 || scan_code == 0xe1 )
+        kbd_raw_prefix = 1;
+    else if ( scan_code == PS2_SCAN_LSHIFT )
+        kbd_raw_lshift = 1;
+    else if ( scan_code == PS2_KH_BATOK )
+        kbd_raw_lshift = 0;
 }
 
 /* ----------------------------------------------------------------------------
@@ -643,181 +1792,1418 @@ int kbd_code_set(int set)
  *     7    Must be zero
  *
  *  param:  typematic rate and delay
- *  return: PS2_KH_ACK no errors, other keyboard response if error
+ *  return: -1 command queue full, 0 command queued
  */
 int kbd_typematic_set(uint8_t configuration)
 {
-    int temp_scan_code;
+    return kbd_command(PS2_HK_TMDELAY, configuration & 0x7f, 0);
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_command()
+ *
+ *  Queue a command to the keyboard command engine.
+ *  The command is sent by kbd_service() when all previously queued
+ *  commands are complete.
+ *
+ *  param:  command byte, data byte or -1 for a single byte command,
+ *          and 1 if a response byte follows the last ACK
+ *  return: -1 command queue full, 0 command queued
+ */
+int kbd_command(uint8_t command, int data, uint8_t response)
+{
+    kbd_cmd_t  *cmd;
 
-    configuration &= 0x7f;
+    if ( (uint8_t)(kbd_cmd_in - kbd_cmd_out) >= KBD_CMD_QUEUE )
+        return -1;
 
-    ps2_send(PS2_HK_TMDELAY);
-    temp_scan_code = ps2_recv_x();
+    cmd = &kbd_cmd_queue[kbd_cmd_in & KBD_CMD_MASK];
+    cmd->command = command;
+    cmd->data = (uint8_t)data;
+    cmd->length = ( data == -1 ) ? 1 : 2;
+    cmd->response = response;
 
-    if ( temp_scan_code == PS2_KH_ACK )
-    {
-        ps2_send(configuration);
-        temp_scan_code = ps2_recv_x();
-    }
+    kbd_cmd_in++;
 
-    return temp_scan_code;
+    return 0;
 }
 
 /* ----------------------------------------------------------------------------
- * read_key()
+ * kbd_cmd_send()
  *
- *  Get a byte from the keyboard output buffer
+ *  Send the current byte of the command at the head of the queue
+ *  and start its reply timeout.
  *
  *  param:  none
- *  return: -1 if buffer empty, otherwise data byte value of key code
- *
+ *  return: none
  */
-int read_key(void)
+void kbd_cmd_send(void)
 {
-    int     result = -1;
+    kbd_cmd_t  *cmd;
 
-    if ( key_code_count > 0 )
-    {
-        result = (int)key_codes[key_buffer_out];
-        key_code_count--;
-        key_buffer_out++;
-        if ( key_buffer_out == KEY_BUFF_SIZE )
-            key_buffer_out = 0;
-    }
+    cmd = &kbd_cmd_queue[kbd_cmd_out & KBD_CMD_MASK];
 
-    return result;
+    ps2_send( (kbd_cmd_byte == 0) ? cmd->command : cmd->data );
+
+    kbd_cmd_timer = timer_ms();
+    kbd_cmd_state = KBD_CMD_SEND;
 }
 
 /* ----------------------------------------------------------------------------
- * write_key()
- *
- *  Write a byte to the keyboard output buffer
+ * kbd_cmd_retry_send()
  *
- *  param:  key code to write
- *  return: -1 if buffer is full, otherwise data byte value of keycode
+ *  Resend the current command byte after a RESEND reply, a transmit error or
+ *  a timeout. Once the retries are exhausted drop the command.
  *
+ *  param:  none
+ *  return: none
  */
-int write_key(uint8_t key_code)
+void kbd_cmd_retry_send(void)
 {
-    int     result = -1;
+    if ( ps2_send_status() == PS2_TX_BUSY )
+        ps2_send_cancel();
 
-    if ( key_code_count < KEY_BUFF_SIZE )
+    kbd_cmd_retry++;
+    if ( kbd_cmd_retry > KBD_CMD_RETRIES )
     {
-        key_codes[key_buffer_in] = key_code;
-        result = (int) key_code;
-        key_code_count++;
-        key_buffer_in++;
-        if ( key_buffer_in == KEY_BUFF_SIZE )
-            key_buffer_in = 0;
+        kbd_cmd_result = PS2_KH_RESEND;
+        kbd_cmd_out++;
+        kbd_cmd_state = KBD_CMD_IDLE;
+    }
+    else
+    {
+        kbd_cmd_send();
     }
-
-    return result;
 }
 
 /* ----------------------------------------------------------------------------
- * This ISR will trigger when PB3 changes state.
- * PB3 is connected to the PS2 keyboard clock line, and PB4 to the data line.
- * ISR will check PB3 state and determine if it is '0' or '1',
- * as well as track clock counts and input bits from PB4.
- * Once input byte is assembled is will be added to a circular buffer.
+ * kbd_service()
  *
+ *  Run the keyboard command engine. Should be called with every byte read
+ *  from the PS2 input buffer, or -1 when there is none, so that command
+ *  replies can be matched while scan codes continue to flow.
+ *  Only ACK and RESEND bytes that arrive while a reply is pending, and the
+ *  response byte of a query command checked by kbd_response_match(), are consumed.
+ *  All other bytes are returned to the caller for translation.
+ *
+ *  param:  scan code from ps2_recv()
+ *  return: -1 if no scan code or scan code consumed, otherwise the scan code
  */
-ISR(PCINT0_vect)
+int kbd_service(int scan_code)
 {
-    uint8_t         ps2_data_bit;
+    kbd_cmd_t  *cmd;
 
-    if ( (PINB & PS2_CLOCK) == 0 )
+    switch ( kbd_cmd_state )
     {
-        ps2_data_bit = (PINB & PS2_DATA) >> 4;
+        /* Start the next queued command
+         */
+        case KBD_CMD_IDLE:
+            if ( kbd_cmd_in != kbd_cmd_out && ps2_send_status() != PS2_TX_BUSY )
+            {
+                kbd_cmd_byte = 0;
+                kbd_cmd_retry = 0;
+                kbd_cmd_send();
+            }
+            break;
 
-        switch ( ps2_rx_state )
-        {
-            /* Do nothing if an error was already signaled
-             * let the main loop handle the error
-             */
-            case PS2_RX_ERR_START:
-            case PS2_RX_ERR_OVERRUN:
-            case PS2_RX_ERR_PARITY:
-            case PS2_RX_ERR_STOP:
-                break;
+        /* Wait for the transmit to complete
+         */
+        case KBD_CMD_SEND:
+            switch ( ps2_send_status() )
+            {
+                case PS2_TX_OK:
+                    kbd_cmd_state = KBD_CMD_REPLY;
+                    break;
 
-            /* If in idle, then check for valid start bit
-             */
-            case PS2_IDLE:
-                if ( ps2_data_bit == 0 )
+                case PS2_TX_ERR:
+                    kbd_cmd_retry_send();
+                    break;
+
+                default:
+                    if ( (uint8_t)(timer_ms() - kbd_cmd_timer) > KBD_CMD_TIMEOUT )
+                        kbd_cmd_retry_send();
+            }
+            break;
+
+        /* Match the keyboard's reply and advance to the next byte or command
+         */
+        case KBD_CMD_REPLY:
+            if ( scan_code == PS2_KH_ACK )
+            {
+                scan_code = -1;
+                cmd = &kbd_cmd_queue[kbd_cmd_out & KBD_CMD_MASK];
+                kbd_cmd_byte++;
+                if ( kbd_cmd_byte < cmd->length )
+                {
+                    kbd_cmd_retry = 0;
+                    kbd_cmd_send();
+                }
+                else if ( cmd->response )
                 {
-                    ps2_rx_data_byte = 0;
-                    ps2_rx_bit_count = 0;
-                    ps2_rx_parity = 0;
-                    ps2_rx_state = PS2_DATA_BITS;
+                    kbd_cmd_timer = timer_ms();
+                    kbd_cmd_state = KBD_CMD_RESPONSE;
                 }
                 else
-                    ps2_rx_state = PS2_RX_ERR_START;
-                break;
+                {
+                    kbd_cmd_result = PS2_KH_ACK;
+                    kbd_cmd_out++;
+                    kbd_cmd_state = KBD_CMD_IDLE;
+                }
+            }
+            else if ( scan_code == PS2_KH_RESEND )
+            {
+                scan_code = -1;
+                kbd_cmd_retry_send();
+            }
+            else if ( (uint8_t)(timer_ms() - kbd_cmd_timer) > KBD_CMD_TIMEOUT )
+            {
+                kbd_cmd_retry_send();
+            }
+            break;
 
-            /* Accumulate eight bits of data LSB first
-             */
-            case PS2_DATA_BITS:
-                ps2_rx_parity += ps2_data_bit;
-                ps2_data_bit = ps2_data_bit << ps2_rx_bit_count;
-                ps2_rx_data_byte += ps2_data_bit;
-                ps2_rx_bit_count++;
-                if ( ps2_rx_bit_count == 8 )
-                    ps2_rx_state = PS2_PARITY;
+        /* The first byte after the last ACK that fits the command is its response,
+         * other bytes are scan codes and pass on to translation.
+         * The command already completed so a timeout is not retried
+         */
+        case KBD_CMD_RESPONSE:
+            cmd = &kbd_cmd_queue[kbd_cmd_out & KBD_CMD_MASK];
+            if ( scan_code != -1 && kbd_response_match(cmd->command, (uint8_t)scan_code) )
+            {
+                kbd_cmd_response = (uint8_t)scan_code;
+                kbd_cmd_result = PS2_KH_ACK;
+                scan_code = -1;
+            }
+            else if ( (uint8_t)(timer_ms() - kbd_cmd_timer) > KBD_CMD_TIMEOUT )
+            {
+                kbd_cmd_result = PS2_KH_RESEND;
+            }
+            else
+            {
                 break;
+            }
+            kbd_cmd_out++;
+            kbd_cmd_state = KBD_CMD_IDLE;
+            break;
+    }
 
-            /* Evaluate the parity and signal error if it is wrong
-             */
-            case PS2_PARITY:
-                if ( ((ps2_rx_parity + ps2_data_bit) & 1) )
-                    ps2_rx_state = PS2_STOP;
-                else
-                    ps2_rx_state = PS2_RX_ERR_PARITY;
-                break;
+    return scan_code;
+}
 
-            /* Check for valid stop bit
-             */
-            case PS2_STOP:
-                if ( ps2_data_bit == 1 )
-                {
-                    if ( ps2_scan_code_count < PS2_BUFF_SIZE )
-                    {
-                        ps2_scan_codes[ps2_buffer_in] = ps2_rx_data_byte;
-                        ps2_scan_code_count++;
-                        ps2_buffer_in++;
-                        if ( ps2_buffer_in == PS2_BUFF_SIZE )
-                            ps2_buffer_in = 0;
-                        ps2_rx_state = PS2_IDLE;
-                    }
-                    else
-                        ps2_rx_state = PS2_RX_ERR_OVERRUN;
-                }
-                else
-                    ps2_rx_state = PS2_RX_ERR_STOP;
-                break;
-        }
+/* ----------------------------------------------------------------------------
+ * kbd_response_match()
+ *
+ *  Check whether a byte received after the last ACK of a query command
+ *  can be the command's response. A scan code that arrives between the ACK
+ *  and the response is then not taken as the response.
+ *  Set 1 make codes with the value of a set ID are still taken as the response.
+ *
+ *  param:  command byte, received byte
+ *  return: 1 the byte is a response to the command, 0 it is a scan code
+ */
+int kbd_response_match(uint8_t command, uint8_t byte)
+{
+    switch ( command )
+    {
+        case PS2_HK_ALTCODE:
+            return ( byte == PS2_SET1_ID || byte == PS2_SET1_XID ||
+                     byte == PS2_SET2_ID || byte == PS2_SET2_XID ||
+                     byte == PS2_SET3_ID || byte == PS2_SET3_XID );
+
+        default:
+            return 1;
     }
 }
 
 /* ----------------------------------------------------------------------------
- * This ISR will trigger when the USI counter overflows indicating
- * 8-bits have been received/transmitted into/from the data buffer
+ * kbd_wait()
  *
+ *  Run the keyboard command engine until all queued commands are complete.
+ *  Scan codes received while waiting are discarded.
+ *  For use during initialization, before entering the main loop.
+ *
+ *  param:  none
+ *  return: none
  */
-ISR(USI_OVF_vect)
+void kbd_wait(void)
 {
-    int     data;
+    do
+    {
+        kbd_service(ps2_recv());
+    } while ( kbd_cmd_state != KBD_CMD_IDLE || kbd_cmd_in != kbd_cmd_out );
+}
 
-    // Get byte received as command
-    command_in = USIDR;
+/* ----------------------------------------------------------------------------
+ * timer_ms()
+ *
+ *  Get the free running 1mSec system tick
+ *
+ *  param:  none
+ *  return: tick count, wraps around every 256mSec
+ */
+uint8_t timer_ms(void)
+{
+    return timer_ticks;
+}
 
-    // Load new keyboard ASCII, if one is available
-    if ( ( data = read_key() ) == -1 )
-        USIDR = 0;
-    else
-        USIDR = (uint8_t) data;
+/* ----------------------------------------------------------------------------
+ * kbd_translate()
+ *
+ *  Translate one scan code byte into a key code.
+ *  Prefix bytes advance the decoder state which carries over between calls,
+ *  so a multi-byte sequence never blocks waiting for its next byte.
+ *  - Handle 'E0' modifier for keypad by removing the 'E0' which will effectively
+ *    reduce any keyboard to one that is equivalent to an 83 key keyboard.
+ *    Discard PrtScrn E0,2A,E0,37 and E0,B7,E0,AA; no support print screen.
+ *  - Discard E1,1D,45 E1,9D,C5 sequence of Pause/Break
+ *
+ *  param:  scan code byte
+ *  return: key code, or 0 if the byte was consumed or discarded
+ */
+uint8_t kbd_translate(uint8_t scan_code)
+{
+    uint8_t key_code = 0;
 
-    // Reset for next byte sequence
-    USISR &= ~USI_COUNTER; // TODO: may not be needed
-    USISR |= USI_CNTR_OVRF;
+    switch ( scan_dec_state )
+    {
+        case SCAN_DEC_E0:
+            key_code = pgm_read_byte(&scan_code_e0_xlate[scan_code]);
+            scan_dec_state = SCAN_DEC_IDLE;
+            break;
+
+        case SCAN_DEC_E1_DROP:
+            scan_dec_state = SCAN_DEC_IDLE;
+            break;
+
+        /* Only 'E1,1D' and 'E1,9D' are Pause/Break sequences,
+         * anything else is processed as a new scan code
+         */
+        case SCAN_DEC_E1:
+            if ( scan_code == 0x1d || scan_code == 0x9d )
+            {
+                scan_dec_state = SCAN_DEC_E1_DROP;
+                break;
+            }
+            scan_dec_state = SCAN_DEC_IDLE;
+            /* fall through */
+
+        case SCAN_DEC_IDLE:
+            if ( scan_code == 0xe0 )
+                scan_dec_state = SCAN_DEC_E0;
+            else if ( scan_code == 0xe1 )
+                scan_dec_state = SCAN_DEC_E1;
+            else
+                key_code = pgm_read_byte(&scan_code_xlate[scan_code]);
+            break;
+    }
+
+    return key_code;
+}
+
+#if ( ISR_XLATE )
+/* ----------------------------------------------------------------------------
+ * kbd_isr_xlate_update()
+ *
+ *  Hand scan code translation to PCINT0_vect, or take it back.
+ *  The ISR only translates when nothing else needs the received bytes:
+ *  a set 1 keyboard, no keyboard command or RESEND in progress or queued, and
+ *  an output mode without time stamps, sequence numbers, repeat filtering or generation,
+ *  or KEY_ALL_UP markers. Translation moves to the ISR only when the PS2 input
+ *  buffer is empty, so key codes stay in order and the prefix decoder state
+ *  'scan_dec_state' is owned by one side at a time.
+ *  Must be called before kbd_service() can start a command, so the reply
+ *  is not translated.
+ *
+ *  param:  none
+ *  return: none
+ */
+void kbd_isr_xlate_update(void)
+{
+    uint8_t eligible;
+
+    eligible = ( kbd_scan_set == 1 &&
+                 (output_mode & OUT_MODE_ENC) != OUT_MODE_RAW &&
+                 (output_mode & (OUT_MODE_SEQ | OUT_MODE_TIME | OUT_MODE_KEYUP | OUT_MODE_NOREP)) == 0 &&
+                 key_repeat_rate == 0 &&
+                 !key_all_up_pending &&
+                 !spi_flush &&
+                 !ps2_rx_resend &&
+                 kbd_hotplug_state == KBD_HP_IDLE &&
+                 kbd_cmd_state == KBD_CMD_IDLE &&
+                 kbd_cmd_in == kbd_cmd_out );
+
+    if ( !eligible )
+    {
+        ps2_isr_xlate = 0;
+        return;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if ( ps2_buffer_in == ps2_buffer_out )
+            ps2_isr_xlate = 1;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * kbd_isr_translate()
+ *
+ *  Translate a received scan code byte and output its key code,
+ *  called by PCINT0_vect on the stop bit while 'ps2_isr_xlate' is set.
+ *  This is the kbd_process() path for the translated and matrix
+ *  modes, the caller checks that the output buffer has room.
+ *
+ *  param:  scan code byte
+ *  return: none
+ */
+void kbd_isr_translate(uint8_t scan_code)
+{
+    uint8_t key_code;
+
+    key_code = kbd_translate(scan_code);
+    if ( key_code == 0 )
+        return;
+
+    key_map_update(key_code);
+
+    key_code = key_encode(key_code);
+    if ( key_code == 0 )
+        return;
+
+    write_key(key_code);
+    STATS_HIST(rx_hist, 0);
+
+    // spi_status_update() without re-enabling interrupts
+    if ( (output_mode & OUT_MODE_DRDY) && spi_idle && HAL_SPI_IDLE() )
+        SPI_IDLE_LOAD();
+}
+#endif
+
+/* ----------------------------------------------------------------------------
+ * kbd_set2_convert()
+ *
+ *  Convert one scan code set 2 byte into the equivalent set 1 byte for kbd_translate().
+ *  The 'F0' break prefix is consumed and sets b7 of the following code,
+ *  'E0' and 'E1' prefixes pass through in their original position, so
+ *  E0,F0,75 becomes E0,C8 and E1,14,77,E1,F0,14,F0,77 becomes E1,1D,45,E1,9D,C5.
+ *  Codes without a set 1 equivalent become 0x00 or 0x80, which end
+ *  any pending prefix sequence and are discarded.
+ *
+ *  param:  set 2 scan code byte, or -1 if none
+ *  return: -1 if no scan code or byte consumed, otherwise set 1 scan code
+ */
+int kbd_set2_convert(int scan_code)
+{
+    uint8_t set1_code;
+
+    if ( scan_code == -1 )
+        return -1;
+
+    if ( scan_code == PS2_KH_BREAK )
+    {
+        scan_set2_break = 0x80;
+        return -1;
+    }
+
+    if ( scan_code == 0xe0 || scan_code == 0xe1 )
+        return scan_code;
+
+    if ( scan_code <= PS2_SET2_LAST )
+        set1_code = pgm_read_byte(&scan_code_set2_xlate[scan_code]);
+    else
+        set1_code = 0;
+
+    set1_code |= scan_set2_break;
+    scan_set2_break = 0;
+
+    return set1_code;
+}
+
+/* ----------------------------------------------------------------------------
+ * key_stage()
+ *
+ *  Move the next key code from the keyboard output buffer into
+ *  the 'spi_key_next' holding register, if the register is empty.
+ *  An OUT_MODE_SEQ sequence byte gets KEY_SEQ_MORE when more key codes
+ *  follow it, also if they are written after the byte was staged.
+ *  Called by main(), USI_OVF_vect restages with KEY_STAGE() after each poll or burst byte.
+ *
+ *  param:  none
+ *  return: none
+ */
+void key_stage(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        KEY_STAGE();
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * write_key()
+ *
+ *  Write a byte to the keyboard output buffer
+ *
+ *  param:  key code to write
+ *  return: -1 if buffer is full, otherwise data byte value of keycode
+ *
+ */
+int write_key(uint8_t key_code)
+{
+    int     result = -1;
+    uint8_t in = key_buffer_in;
+
+    if ( (uint8_t)(in - key_buffer_out) < KEY_BUFF_SIZE )
+    {
+        key_codes[in & KEY_BUFF_MASK] = key_code;
+#if ( INSTRUMENT )
+        key_times[in & KEY_BUFF_MASK] = timer_ticks;
+#endif
+        result = (int) key_code;
+        key_buffer_in = in + 1;
+        STATS_PEAK(key_peak, (uint8_t)(in + 1 - key_buffer_out));
+    }
+
+    return result;
+}
+
+/* ----------------------------------------------------------------------------
+ * This ISR will trigger when PB3 changes state.
+ * PB3 is connected to the PS2 keyboard clock line, and PB4 to the data line.
+ * ISR will check PB3 state and determine if it is '0' or '1',
+ * as well as track clock counts and input bits from PB4.
+ * Once input byte is assembled is will be added to a circular buffer.
+ * When a host to keyboard transmit is in progress the ISR clocks
+ * out the transmit frame instead of receiving.
+ *
+ * Receive path cycle estimate with all build options off. The figures are hand
+ * counts per instruction of the code avr-gcc -Os is expected to generate, not taken
+ * from a disassembly, and are to be confirmed with the 'make lst' listing and the
+ * 'pcint_max' statistic of a device build:
+ *
+ *  Interrupt response and vector jump     6
+ *  Prologue, 4 registers and SREG        13
+ *  Port sample, clock and TX tests        7
+ *  State dispatch                         8
+ *  Worst state, stop bit with FIFO store 27
+ *  Epilogue and RETI                     17
+ *  ------------------------------------ ---
+ *  Worst case, estimate                  78 cycles
+ *
+ * A frame with an error also ends on its stop bit edge, with PS2_RX_ERROR() in place
+ * of the FIFO store, which is no longer than the store and its INSTRUMENT peak update.
+ *
+ * Each build option adds to the stop bit edge, estimated the same way, the other edges stay shorter:
+ *
+ *  INSTRUMENT, cycle count, FIFO peak and 3 more registers   +60
+ *  TRACE_BUFF_SIZE, TRACE_PUT entry and 2 more registers   +46
+ *  ISR_XLATE, translation calls instead of the FIFO store  +220
+ *  and the full call-clobbered prologue
+ *
+ * The default build, with INSTRUMENT and the trace buffer, comes to an estimated 184 cycles,
+ * 23uSec at 8MHz and 11.5uSec at 16MHz. TRACE_PUT costs about 10 cycles while capture is off.
+ * With all options off it is about 9.8uSec at 8MHz and 4.9uSec at 16MHz.
+ * The port is sampled within ~30 cycles (3.8uSec at 8MHz) of the falling clock edge,
+ * well inside the keyboard's minimum 30uSec clock low time.
+ * The ISR_XLATE stop bit is still done long before the keyboard's next frame,
+ * but it delays USI_OVF_vect by as much, and its ISR body can exceed the
+ * 255 cycle range of the 'pcint_max' statistic.
+ * The count does not include waiting for a USI_OVF_vect in progress.
+ * The 'pcint_max' statistic measures the ISR body on the device, add the estimated
+ * response, prologue and epilogue, at least 36 cycles, to compare it with these figures.
+ *
+ */
+ISR(PS2_CLOCK_vect)
+{
+    uint8_t         pins;
+    uint8_t         ps2_data_bit;
+    uint8_t         in;
+
+    STATS_ISR_START();
+
+    pins = PS2_PIN;
+
+    if ( (pins & PS2_CLOCK) == 0 )
+    {
+        if ( ps2_tx_state != PS2_TX_IDLE )
+        {
+            switch ( ps2_tx_state )
+            {
+                /* Clock edges generated by the host holding the clock line low
+                 */
+                case PS2_TX_IDLE:
+                case PS2_TX_INHIBIT:
+                    break;
+
+                /* Output eight bits of data LSB first, then parity and stop bits.
+                 * The data line is changed while clock is low, and is sampled by
+                 * the keyboard on the rising edge
+                 */
+                case PS2_TX_DATA:
+                    if ( ps2_tx_bit_count < 8 )
+                    {
+                        ps2_data_bit = ps2_tx_data_byte & 0x01;
+                        ps2_tx_parity += ps2_data_bit;
+                        ps2_tx_data_byte = ps2_tx_data_byte >> 1;
+                    }
+                    else if ( ps2_tx_bit_count == 8 )
+                    {
+                        ps2_data_bit = ps2_tx_parity & 0x01;
+                    }
+                    else
+                    {
+                        ps2_data_bit = 1;
+                    }
+
+                    if ( ps2_tx_bit_count == 9 )
+                    {
+                        // Stop bit, restore data line to receive mode
+                        PS2_DDR &= ~PS2_DATA;
+                        PS2_PORT |= PS2_DATA;
+                        ps2_tx_state = PS2_TX_ACK;
+                    }
+                    else if ( ps2_data_bit )
+                        PS2_PORT |= PS2_DATA;
+                    else
+                        PS2_PORT &= ~PS2_DATA;
+
+                    ps2_tx_bit_count++;
+                    break;
+
+                /* Keyboard pulls data line low to acknowledge the frame
+                 */
+                case PS2_TX_ACK:
+                    if ( pins & PS2_DATA )
+                        ps2_tx_result = PS2_TX_ERR;
+                    else
+                        ps2_tx_result = PS2_TX_OK;
+                    ps2_tx_state = PS2_TX_IDLE;
+                    break;
+            }
+        }
+        else
+        {
+            ps2_rx_time = timer_ticks;
+
+            switch ( ps2_rx_state )
+            {
+                /* Count the rest of a frame with a start bit or parity error,
+                 * so that the frame ends on its stop bit edge and the next frame is received.
+                 * The Timer0 ISR returns the receiver to idle if the clock stops first
+                 */
+                case PS2_RX_ERR_START:
+                    if ( (++ps2_rx_count & PS2_RX_BITS) == PS2_RX_STOP_BIT )
+                        PS2_RX_ERROR(PS2_RX_ERR_START, start, 0);
+                    break;
+
+                case PS2_RX_ERR_PARITY:
+                    if ( (++ps2_rx_count & PS2_RX_BITS) == PS2_RX_STOP_BIT )
+                        PS2_RX_ERROR(PS2_RX_ERR_PARITY, parity, 1);
+                    break;
+
+                // Entered on the stop bit edge, PS2_RX_ERROR() ends these frames at once
+                case PS2_RX_ERR_OVERRUN:
+                case PS2_RX_ERR_STOP:
+                    break;
+
+                /* If in idle, then check for valid start bit.
+                 * The shift register needs no reset, all its bits are replaced by data bits
+                 */
+                case PS2_IDLE:
+                    ps2_rx_count = 0;
+                    if ( (pins & PS2_DATA) == 0 )
+                        ps2_rx_state = PS2_DATA_BITS;
+                    else
+                        ps2_rx_state = PS2_RX_ERR_START;
+                    break;
+
+                /* Shift in eight bits of data LSB first, and toggle
+                 * the parity bit for every '1'
+                 */
+                case PS2_DATA_BITS:
+                    ps2_rx_shift >>= 1;
+                    if ( pins & PS2_DATA )
+                    {
+                        ps2_rx_shift |= 0x80;
+                        ps2_rx_count ^= PS2_RX_PARITY;
+                    }
+                    ps2_rx_count++;
+                    if ( (ps2_rx_count & PS2_RX_BITS) == 8 )
+                        ps2_rx_state = PS2_PARITY;
+                    break;
+
+                /* Evaluate the odd parity and signal error if it is wrong
+                 */
+                case PS2_PARITY:
+                    ps2_rx_count++;
+                    if ( pins & PS2_DATA )
+                        ps2_rx_count ^= PS2_RX_PARITY;
+                    if ( ps2_rx_count & PS2_RX_PARITY )
+                        ps2_rx_state = PS2_STOP;
+                    else
+                        ps2_rx_state = PS2_RX_ERR_PARITY;
+                    break;
+
+                /* Check for valid stop bit
+                 */
+                case PS2_STOP:
+                    if ( pins & PS2_DATA )
+                    {
+#if ( ISR_XLATE )
+                        TRACE_PUT(TRACE_RX, ps2_rx_shift);
+
+                        /* Translate in place, or hand this and all following bytes
+                         * back to main() when the key code output buffer is full
+                         * or for a possible BAT code that needs re-plug detection
+                         */
+                        if ( ps2_isr_xlate )
+                        {
+                            if ( (uint8_t)(key_buffer_in - key_buffer_out) < KEY_BUFF_SIZE &&
+                                 ps2_rx_shift != PS2_KH_BATOK )
+                            {
+                                kbd_isr_translate(ps2_rx_shift);
+                                ps2_rx_state = PS2_IDLE;
+                                break;
+                            }
+                            ps2_isr_xlate = 0;
+                        }
+#endif
+#if ( !ISR_XLATE )
+                        TRACE_PUT(TRACE_RX, ps2_rx_shift);
+#endif
+                        in = ps2_buffer_in;
+                        if ( (uint8_t)(in - ps2_buffer_out) < PS2_BUFF_SIZE )
+                        {
+                            ps2_scan_codes[in & PS2_BUFF_MASK] = ps2_rx_shift;
+                            ps2_scan_times[in & PS2_BUFF_MASK] = timer_ticks;
+                            ps2_buffer_in = in + 1;
+                            STATS_PEAK(ps2_peak, (uint8_t)(in + 1 - ps2_buffer_out));
+                            ps2_rx_state = PS2_IDLE;
+                        }
+                        else
+                            PS2_RX_ERROR(PS2_RX_ERR_OVERRUN, overrun, 0);
+                    }
+                    else
+                        PS2_RX_ERROR(PS2_RX_ERR_STOP, stop, 1);
+                    break;
+            }
+        }
+    }
+
+    STATS_ISR_END(pcint_max, pcint_avg, stats_pcint_acc);
+}
+
+/* ----------------------------------------------------------------------------
+ * write_key_frame()
+ *
+ *  Write a key code and its data bytes to the keyboard output buffer.
+ *  All bytes become visible to the reader at the same time,
+ *  so a burst read never splits the frame.
+ *
+ *  param:  frame bytes starting with the key code, and frame length
+ *  return: -1 if buffer is full, otherwise data byte value of keycode
+ *
+ */
+int write_key_frame(uint8_t *frame, uint8_t length)
+{
+    uint8_t in = key_buffer_in;
+    uint8_t i;
+
+    if ( (uint8_t)(in - key_buffer_out) > (uint8_t)(KEY_BUFF_SIZE - length) )
+        return -1;
+
+    for ( i = 0; i < length; i++ )
+    {
+        key_codes[(uint8_t)(in + i) & KEY_BUFF_MASK] = frame[i];
+#if ( INSTRUMENT )
+        key_times[(uint8_t)(in + i) & KEY_BUFF_MASK] = timer_ticks;
+#endif
+    }
+
+    key_buffer_in = in + length;
+    STATS_PEAK(key_peak, (uint8_t)(in + length - key_buffer_out));
+
+    return (int) frame[0];
+}
+
+/* ----------------------------------------------------------------------------
+ * key_write()
+ *
+ *  Write a key code to the keyboard output buffer in the format of the
+ *  selected output mode. The sequence byte carries 'key_seq', the caller
+ *  advances it for every key code whether or not it was written.
+ *
+ *  param:  key code and its time delta
+ *  return: -1 if buffer is full, otherwise data byte value of keycode
+ *
+ */
+int key_write(uint8_t key_code, uint8_t time_delta)
+{
+    uint8_t frame[3];
+    uint8_t length = 1;
+
+    if ( (output_mode & (OUT_MODE_TIME | OUT_MODE_SEQ)) == 0 )
+        return write_key(key_code);
+
+    frame[0] = key_code;
+
+    if ( output_mode & OUT_MODE_TIME )
+        frame[length++] = time_delta;
+
+    if ( output_mode & OUT_MODE_SEQ )
+        frame[length++] = key_seq & KEY_SEQ_NUM;
+
+    return write_key_frame(frame, length);
+}
+
+/* ----------------------------------------------------------------------------
+ * key_evict_make()
+ *
+ *  Remove the newest make code from the keyboard output buffer to make room
+ *  for a break code. Dropping a make code can only lose a key press or
+ *  a typematic repeat, it never leaves a key stuck down in the emulation.
+ *  Interrupts are disabled while the buffer is compacted so that
+ *  USI_OVF_vect does not read it while entries move. The enqueue times
+ *  of an INSTRUMENT build move with their key codes.
+ *
+ *  param:  none
+ *  return: -1 no make code found, 0 make code removed
+ *
+ */
+int key_evict_make(void)
+{
+    int     result = -1;
+    uint8_t stride;
+    uint8_t in;
+    uint8_t i, j;
+
+    stride = KEY_FRAME_LENGTH();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        in = key_buffer_in;
+
+        for ( i = in - stride; (uint8_t)(i - key_buffer_out) < KEY_BUFF_SIZE; i -= stride )
+        {
+            if ( (key_codes[i & KEY_BUFF_MASK] & 0x80) == 0 )
+            {
+                for ( j = i; j != (uint8_t)(in - stride); j++ )
+                {
+                    key_codes[j & KEY_BUFF_MASK] = key_codes[(uint8_t)(j + stride) & KEY_BUFF_MASK];
+#if ( INSTRUMENT )
+                    key_times[j & KEY_BUFF_MASK] = key_times[(uint8_t)(j + stride) & KEY_BUFF_MASK];
+#endif
+                }
+
+                key_buffer_in = in - stride;
+                result = 0;
+                break;
+            }
+        }
+    }
+
+    return result;
+}
+
+/* ----------------------------------------------------------------------------
+ * key_output()
+ *
+ *  Output a key code to the host through the keyboard output buffer.
+ *  When the buffer is full a break code replaces the newest queued make code,
+ *  so that keys do not stay stuck down in the emulation. Any overflow sets the
+ *  sticky 'key_overflow' flag. If a break code is lost anyway, and OUT_MODE_KEYUP is set,
+ *  a KEY_ALL_UP marker is queued ahead of the next key code that fits. A key code
+ *  dropped because the marker itself does not fit also sets 'key_overflow'.
+ *
+ *  param:  key code
+ *  return: none
+ *
+ */
+void key_output(uint8_t key_code)
+{
+    uint8_t time_delta = 0;
+
+    if ( output_mode & OUT_MODE_TIME )
+    {
+        time_delta = ps2_recv_time - key_time;
+        if ( key_time_saturated )
+            time_delta = KEY_TIME_MAX;
+    }
+
+    if ( key_all_up_pending )
+    {
+        if ( key_write(KEY_ALL_UP, time_delta) == -1 )
+        {
+            key_overflow = 1;
+            key_seq++;
+            return;
+        }
+
+        key_seq++;
+        key_all_up_pending = 0;
+        time_delta = 0;
+    }
+
+    if ( key_write(key_code, time_delta) == -1 )
+    {
+        key_overflow = 1;
+
+        if ( (key_code & 0x80) == 0 ||
+             (output_mode & OUT_MODE_ENC) == OUT_MODE_RAW ||
+             key_evict_make() == -1 ||
+             key_write(key_code, time_delta) == -1 )
+        {
+            if ( (key_code & 0x80) && (output_mode & OUT_MODE_KEYUP) )
+                key_all_up_pending = 1;
+            key_seq++;
+            return;
+        }
+    }
+
+    key_seq++;
+
+    key_time = ps2_recv_time;
+    key_time_saturated = 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * key_map_update()
+ *
+ *  Update the pressed-key bitmap from a translated make or break code.
+ *  The bitmap is updated one byte at a time, so the host always
+ *  reads a consistent state for each byte.
+ *
+ *  param:  key code
+ *  return: none
+ *
+ */
+void key_map_update(uint8_t key_code)
+{
+    uint8_t key = key_code & 0x7f;
+    uint8_t mask;
+
+    if ( key >= KEY_MAP_KEYS )
+        return;
+
+    mask = 1 << (key & 0x07);
+
+    if ( key_code & 0x80 )
+        key_map[key >> 3] &= ~mask;
+    else
+        key_map[key >> 3] |= mask;
+}
+
+/* ----------------------------------------------------------------------------
+ * key_map_held()
+ *
+ *  Check if a make code is a typematic repeat, that is, if its key
+ *  is already down in the pressed-key bitmap.
+ *
+ *  param:  key code
+ *  return: 1 make code of a key already down, otherwise 0
+ *
+ */
+int key_map_held(uint8_t key_code)
+{
+    if ( (key_code & 0x80) || key_code >= KEY_MAP_KEYS )
+        return 0;
+
+    return ( key_map[key_code >> 3] & (1 << (key_code & 0x07)) ) ? 1 : 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * key_repeat_update()
+ *
+ *  Track the last key pressed for AVR generated repeats.
+ *  A make code restarts the repeat delay, the break code of the
+ *  repeating key stops it.
+ *
+ *  param:  translated key code
+ *  return: none
+ *
+ */
+void key_repeat_update(uint8_t key_code)
+{
+    if ( (key_code & 0x80) == 0 )
+    {
+        key_repeat_code = key_code;
+        key_repeat_wait = (((key_repeat_rate & KEY_REP_DELAY) >> 4) + 1) * KEY_REP_DELAY_MS;
+        key_repeat_tick = timer_ms();
+    }
+    else if ( (key_code & 0x7f) == key_repeat_code )
+    {
+        key_repeat_code = 0;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * key_repeat_due()
+ *
+ *  Count down the repeat delay or period of the repeating key.
+ *  Must be called at least every 255mSec while a key repeats, the main loop
+ *  is woken by the 1mSec tick so this only fails if scan codes arrive
+ *  on every pass for that long.
+ *
+ *  param:  none
+ *  return: 1 if a repeat of 'key_repeat_code' is due, otherwise 0
+ *
+ */
+int key_repeat_due(void)
+{
+    uint8_t now, elapsed;
+
+    now = timer_ms();
+    elapsed = now - key_repeat_tick;
+    key_repeat_tick = now;
+
+    if ( key_repeat_code == 0 || key_repeat_rate == 0 ||
+         (output_mode & OUT_MODE_ENC) == OUT_MODE_RAW )
+        return 0;
+
+    if ( elapsed < key_repeat_wait )
+    {
+        key_repeat_wait -= elapsed;
+        return 0;
+    }
+
+    key_repeat_wait = ((key_repeat_rate & KEY_REP_PERIOD) + 1) * KEY_REP_PERIOD_MS;
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * key_encode()
+ *
+ *  Convert a translated key code to the output encoding,
+ *  matrix codes in OUT_MODE_DRAGON and OUT_MODE_COCO
+ *
+ *  param:  translated key code
+ *  return: key code to output, or 0 if the key has no code in this encoding
+ *
+ */
+uint8_t key_encode(uint8_t key_code)
+{
+    if ( (output_mode & OUT_MODE_ENC) == OUT_MODE_DRAGON ||
+         (output_mode & OUT_MODE_ENC) == OUT_MODE_COCO )
+    {
+        key_code = key_matrix(key_code, (output_mode & OUT_MODE_ENC) - OUT_MODE_DRAGON);
+    }
+
+    return key_code;
+}
+
+/* ----------------------------------------------------------------------------
+ * key_matrix()
+ *
+ *  Convert a translated key code to a keyboard matrix code
+ *
+ *  param:  key code, and layout index 0 Dragon, 1 CoCo
+ *  return: matrix code with break flag, or 0 if the key has no matrix position
+ *
+ */
+uint8_t key_matrix(uint8_t key_code, uint8_t layout)
+{
+    uint8_t matrix_code;
+
+    if ( (key_code & 0x7f) > PS2_LAST_CODE )
+        return 0;
+
+    matrix_code = pgm_read_byte(&key_matrix_xlate[layout][key_code & 0x7f]);
+    if ( matrix_code == 0 )
+        return 0;
+
+    return (matrix_code | (key_code & 0x80));
+}
+
+/* ----------------------------------------------------------------------------
+ * spi_status_update()
+ *
+ *  Refresh the status byte held in SPI_DATA between SPI transfers.
+ *  SPI_DATA's MSB drives DO while the link is idle, so the host can read
+ *  the data pending state from the MISO line level without a transfer.
+ *  SPI_DATA is only written when it holds the idle response and HAL_SPI_IDLE()
+ *  shows no transfer has started.
+ *
+ *  param:  none
+ *  return: none
+ */
+void spi_status_update(void)
+{
+    cli();
+
+    if ( spi_idle && HAL_SPI_IDLE() )
+        SPI_IDLE_LOAD();
+
+    sei();
+}
+
+#if ( INSTRUMENT )
+/* ----------------------------------------------------------------------------
+ * stats_clear()
+ *
+ *  Clear all statistics.
+ *
+ *  param:  none
+ *  return: none
+ */
+void stats_clear(void)
+{
+    uint8_t i;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        for ( i = 0; i < sizeof(stats_t); i++ )
+            ((volatile uint8_t*) &stats)[i] = 0;
+
+        stats_pcint_acc = 0;
+        stats_usi_acc = 0;
+        stats_wake_acc = 0;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * This ISR will trigger on the wake-up probe compare match armed before an idle sleep.
+ * The cycles from the match to the ISR body are the wake-up, the interrupt response
+ * and the ISR prologue. Another interrupt taken inside the window delays the probe,
+ * so it can only overstate the wake-up latency.
+ *
+ */
+ISR(WAKE_PROBE_vect)
+{
+    uint8_t stats_isr_start = HAL_WAKE_MATCH;
+
+    STATS_ISR_END(wake_max, wake_avg, stats_wake_acc);
+    HAL_WAKE_DISARM();
+}
+#endif
+
+/* ----------------------------------------------------------------------------
+ * This ISR will trigger every 1mSec on Timer0 compare match
+ * and advance the system tick.
+ *
+ */
+ISR(TIMER0_COMPA_vect)
+{
+    timer_ticks++;
+
+    /* Resynchronize the PS2 receiver when the clock stopped in the middle of a frame.
+     * Complete frames with an error already ended on their stop bit edge
+     */
+    if ( ps2_rx_state != PS2_IDLE &&
+         ps2_tx_state == PS2_TX_IDLE &&
+         (uint8_t)(timer_ticks - ps2_rx_time) > PS2_RX_TIMEOUT )
+    {
+        TRACE_PUT(TRACE_ERR, ps2_rx_state);
+
+        switch ( ps2_rx_state )
+        {
+            case PS2_RX_ERR_START:
+                ERROR_COUNT(start);
+                break;
+
+            case PS2_RX_ERR_PARITY:
+                ERROR_COUNT(parity);
+                ps2_rx_resend = 1;
+                break;
+
+            default:
+                ERROR_COUNT(timeout);
+        }
+
+        ps2_rx_state = PS2_IDLE;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * This ISR will trigger when the USI counter overflows, or the SPI transfer
+ * completes, indicating 8-bits have been received/transmitted into/from the data buffer
+ *
+ * The byte loaded into SPI_DATA here is the one the host will read
+ * while it clocks in its next command byte.
+ * An SPI_CMD_BURST command returns the key code FIFO depth 'n', and the following
+ * 'n' bytes return key codes regardless of the command bytes the host sends.
+ * The host should send SPI_CMD_NOP bytes to clock out the burst and pad the transfer.
+ *
+ * Key codes come from the 'spi_key_next' holding register staged ahead of time,
+ * so the SPI_DATA store is not delayed by output buffer index math.
+ * After a Poll or burst key code the register is restaged from the output buffer
+ * with KEY_STAGE(), and the ISR makes no function calls, so the prologue only
+ * saves the registers it uses.
+ *
+ * Worst case cycle estimate, a Poll in the default build, counted by hand per instruction
+ * of the code avr-gcc -Os is expected to generate. Like the PCINT0_vect budget it is
+ * not taken from a disassembly, and is to be confirmed with 'make lst' and 'usi_max':
+ *
+ *  Interrupt response and vector jump                6
+ *  Prologue, 10 registers and SREG                  28
+ *  Command byte, burst and data byte tests          14
+ *  Command dispatch to Poll                         12
+ *  Response store                                    3
+ *  ----------------------------------------------- ---
+ *  To the SPI_DATA store                            63 cycles
+ *  Hand out with the 64+ mSec latency histogram bin 72
+ *  Restage with KEY_STAGE()                          70
+ *  USI counter re-arm                                5
+ *  ----------------------------------------------- ---
+ *  To HAL_SPI_NEXT(), estimate                     210 cycles
+ *
+ * The store must land before the host's first sampling edge of the next byte,
+ * and on the USI the counter re-arm must also come before its first clock edge.
+ * A PCINT0_vect in progress (STATS pcint_max) delays both, and a Timer0 tick pending
+ * behind it runs first, as its vector has the higher priority. The estimated gap
+ * required from the host is 184 + ~60 + 210 = 454 cycles in the default build,
+ * 57uSec at 8MHz or 28uSec at 16MHz, and about 670 cycles with ISR_XLATE,
+ * 84uSec at 8MHz or 42uSec at 16MHz. As these are estimates, the gap the host is
+ * told to use adds a 25% margin, rounded up to 5uSec: 75uSec at 8MHz or 40uSec
+ * at 16MHz, and 105uSec or 55uSec with ISR_XLATE. The STATS_ISR_END update, epilogue and
+ * RETI add 69 cycles after the re-arm. With SPI_SS_vect, committing the byte
+ * clocked out adds 10 cycles before the store and 4 to the hand out, and there
+ * is no counter re-arm, so the same gap holds.
+ *
+ */
+ISR(SPI_XFER_vect)
+{
+    uint8_t status;
+
+    STATS_ISR_START();
+
+    // Get byte received as command
+    command_in = SPI_DATA;
+    spi_idle = 0;
+
+#ifdef SPI_SS_vect
+    // The byte loaded by the last call was clocked out, so it is no longer put back
+    spi_key_loaded = 0;
+#if ( TRACE_BUFF_SIZE )
+    trace_out += trace_sent;
+    trace_sent = 0;
+#endif
+#endif
+
+    // Continue a burst read
+    if ( spi_burst_count )
+    {
+        spi_burst_count--;
+        if ( spi_burst_data )
+        {
+            SPI_DATA = *spi_burst_data++;
+            if ( spi_burst_count == 0 )
+                spi_burst_data = 0;
+        }
+#if ( TRACE_BUFF_SIZE )
+        else if ( spi_burst_trace )
+        {
+            switch ( trace_phase )
+            {
+                case 0:
+                    SPI_DATA = trace_type[trace_out & TRACE_BUFF_MASK];
+                    trace_phase = 1;
+                    break;
+
+                case 1:
+                    SPI_DATA = trace_data[trace_out & TRACE_BUFF_MASK];
+                    trace_phase = 2;
+                    break;
+
+                default:
+                    SPI_DATA = trace_time[trace_out & TRACE_BUFF_MASK];
+                    trace_phase = 0;
+#ifdef SPI_SS_vect
+                    trace_sent = 1;
+#else
+                    trace_out++;
+#endif
+            }
+            if ( spi_burst_count == 0 )
+                spi_burst_trace = 0;
+        }
+#endif
+        else
+            KEY_HAND_OUT();
+    }
+
+    // Data byte of a host command
+    else if ( spi_cmd_pending )
+    {
+        switch ( spi_cmd_pending )
+        {
+            case SPI_CMD_TYPEMAT:
+                kbd_typematic = command_in & 0x7f;
+                break;
+
+            case SPI_CMD_LEDS:
+                kbd_lock_keys = command_in & 0x07;
+                break;
+
+            case SPI_CMD_MODE:
+                output_mode = command_in;
+                break;
+
+            case SPI_CMD_REPEAT:
+                key_repeat_rate = command_in;
+                break;
+
+#if ( TRACE_BUFF_SIZE )
+            case SPI_CMD_TRCCTL:
+                if ( command_in & 0x01 )
+                {
+                    trace_out = trace_in;
+                    trace_overflow = 0;
+                }
+                trace_on = command_in & 0x01;
+                break;
+#endif
+        }
+
+        spi_cmd_pending = 0;
+        SPI_IDLE_LOAD();
+    }
+
+    else
+    {
+        switch ( command_in )
+        {
+            // Start a burst read by returning the count of key codes that will follow
+            case SPI_CMD_BURST:
+                spi_burst_count = KEY_PENDING();
+                SPI_DATA = spi_burst_count;
+                break;
+
+            // Commands followed by a data byte
+            case SPI_CMD_TYPEMAT:
+            case SPI_CMD_LEDS:
+            case SPI_CMD_MODE:
+            case SPI_CMD_REPEAT:
+#if ( TRACE_BUFF_SIZE )
+            case SPI_CMD_TRCCTL:
+#endif
+                spi_cmd_pending = command_in;
+                SPI_IDLE_LOAD();
+                break;
+
+            // This ISR is the consumer of 'key_codes[]', main() flushes the PS2 input
+            case SPI_CMD_FLUSH:
+                key_buffer_out = key_buffer_in;
+                spi_key_next = 0;
+                spi_key_staged = 0;
+                spi_key_phase = 0;
+                spi_key_seq = 0;
+#ifdef SPI_SS_vect
+                spi_key_back = 0;
+#endif
+                spi_flush = 1;
+                SPI_IDLE_LOAD();
+                break;
+
+#if ( INSTRUMENT )
+            case SPI_CMD_STATS:
+                spi_burst_data = (volatile uint8_t*) &stats;
+                spi_burst_count = sizeof(stats_t);
+                SPI_DATA = sizeof(stats_t);
+                break;
+
+            case SPI_CMD_STATCLR:
+                spi_stats_clear = 1;
+                SPI_IDLE_LOAD();
+                break;
+#endif
+
+            case SPI_CMD_ERRORS:
+                spi_burst_data = (volatile uint8_t*) &ps2_errors;
+                spi_burst_count = sizeof(ps2_errors_t);
+                SPI_DATA = sizeof(ps2_errors_t);
+                break;
+
+            case SPI_CMD_ERRCLR:
+                spi_errors_clear = 1;
+                SPI_IDLE_LOAD();
+                break;
+
+#if ( TRACE_BUFF_SIZE )
+            // Stream whole trace entries, the ISRs keep capturing during the burst
+            case SPI_CMD_TRACE:
+                spi_burst_count = trace_in - trace_out;
+                if ( spi_burst_count > TRACE_MAX_BURST )
+                    spi_burst_count = TRACE_MAX_BURST;
+                spi_burst_count += spi_burst_count << 1;
+                spi_burst_trace = ( spi_burst_count != 0 );
+                trace_phase = 0;
+                SPI_DATA = spi_burst_count;
+                break;
+#endif
+
+            case SPI_CMD_KEYMAP:
+                spi_burst_data = key_map;
+                spi_burst_count = KEY_MAP_SIZE;
+                SPI_DATA = KEY_MAP_SIZE;
+                break;
+
+            case SPI_CMD_STATUS:
+                status = (( key_overflow ) ? SPI_STAT_OVRFL : 0) |
+                         (( kbd_scan_set == 2 ) ? SPI_STAT_SET2 : 0);
+#if ( TRACE_BUFF_SIZE )
+                if ( trace_overflow )
+                    status |= SPI_STAT_TROVF;
+                trace_overflow = 0;
+#endif
+                if ( reset_flags & MCUSR_WDRF )
+                    status |= SPI_STAT_WDRST;
+                reset_flags = 0;
+                SPI_DATA = status;
+                key_overflow = 0;
+                break;
+
+            case SPI_CMD_NOP:
+                SPI_IDLE_LOAD();
+                spi_idle = 1;
+                break;
+
+            // Return the staged key code, or 0 if none, and stage the next one
+            default:
+                KEY_HAND_OUT();
+        }
+    }
+
+    // Reset for next byte sequence
+    HAL_SPI_NEXT();
+
+    STATS_ISR_END(usi_max, usi_avg, stats_usi_acc);
+}
+
+#ifdef SPI_SS_vect
+/* ----------------------------------------------------------------------------
+ * This ISR will trigger when the SPI slave select line changes state.
+ *
+ * The SPI bit counter is held in reset while SS is high, so every transaction
+ * starts byte aligned. The end of a transaction also ends a burst read or
+ * a command data byte that the host did not clock out, and loads the idle
+ * response for the first byte of the next transaction.
+ * The response byte in SPI_DATA is never clocked out. A key code there is put back
+ * and returned by the next poll or burst byte, and a trace entry is only removed
+ * once its last byte is clocked, so nothing is lost to the host.
+ * The host keeps the inter-byte gap after the last byte too, so SPI_XFER_vect
+ * has handled it before SS rises.
+ *
+ */
+ISR(SPI_SS_vect)
+{
+    if ( !HAL_SPI_IDLE() )
+        return;
+
+    spi_burst_count = 0;
+    spi_burst_data = 0;
+#if ( TRACE_BUFF_SIZE )
+    spi_burst_trace = 0;
+    trace_sent = 0;
+#endif
+    spi_cmd_pending = 0;
+
+    if ( spi_key_loaded )
+    {
+        spi_key_back = 1;
+        spi_key_loaded = 0;
+    }
+
+    SPI_IDLE_LOAD();
+    spi_idle = 1;
 }
+#endif
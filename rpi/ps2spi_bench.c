@@ -0,0 +1,431 @@
+/*
+ * ps2spi_bench.c
+ *
+ *  Key code latency and host CPU cost benchmark for the ps2spi AVR interface.
+ *
+ *  For each poll rate the host reads the AVR for a fixed time with one of
+ *  the read methods, then reads the AVR statistics. The AVR's latency histograms
+ *  measure the keyboard stop bit to key code buffer time, and the key code buffer
+ *  to SPI read time, which together are the keypress-to-host latency on the link.
+ *  The host side adds the SPI transfer time, measured here around each read.
+ *
+ *  The firmware must be built with INSTRUMENT. For a repeatable load hold a key
+ *  down with AVR generated repeat, for example '-r 0x10' for 100 key codes
+ *  per second after 100 mSec.
+ *
+ *  usage: ps2spi_bench [-d device] [-s sclk_hz] [-g gap_us] [-m poll|burst|adaptive]
+ *                      [-t seconds] [-r repeat] [-f] [rate_hz ...]
+ *
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <stdint.h>
+#include    <string.h>
+#include    <time.h>
+#include    <unistd.h>
+#include    <sys/resource.h>
+
+#include    "ps2spi_host.h"
+
+#define     DEF_DEVICE      "/dev/spidev0.0"
+#define     DEF_SPEED       500000      // SCLK Hz
+#define     DEF_GAP         75          // uSec after each byte, estimated for the ATtiny85 at 8MHz with a 25% margin
+#define     DEF_SECONDS     10          // Per poll rate
+#define     BURST_EXPECT    16          // Burst transfer size, longer bursts take a second transfer
+#define     POLL_MAX        PS2SPI_BLOCK_MAX
+
+typedef enum
+{
+    READ_POLL,              // Poll command until the buffer is empty
+    READ_BURST,             // Burst command sized for BURST_EXPECT key codes
+    READ_ADAPTIVE,          // Data ready status, burst only when key codes are pending
+} read_method_t;
+
+typedef struct
+{
+    uint32_t codes;         // Key codes read
+    uint32_t reads;         // Read calls
+    uint32_t transfers;     // SPI_IOC_MESSAGE calls
+    uint32_t bytes;         // Bytes clocked
+    double   read_usec;     // Time spent in read calls
+    double   cpu_sec;       // Process user and system time
+    double   wall_sec;      // Elapsed time
+    uint16_t rx_hist[PS2SPI_STATS_BINS];
+    uint16_t tx_hist[PS2SPI_STATS_BINS];
+    uint8_t  wake_max;      // Idle sleep wake-up to ISR cycles
+    uint8_t  wake_avg;
+} result_t;
+
+/****************************************************************************
+  Function prototypes
+****************************************************************************/
+void    usage(void);
+double  time_sec(const struct timespec *);
+double  cpu_sec(void);
+int     read_codes(ps2spi_t *, read_method_t);
+int     read_stats(ps2spi_t *, result_t *);
+double  hist_mean(const uint16_t *);
+int     hist_percentile(const uint16_t *, int);
+int     run_rate(ps2spi_t *, read_method_t, int, int, result_t *);
+
+/****************************************************************************
+  Globals
+****************************************************************************/
+// Mid point and upper bound of each latency histogram bin in mSec, the last bin is open
+const double    bin_mid[PS2SPI_STATS_BINS] = { 0, 1, 2.5, 5.5, 11.5, 23.5, 47.5, 64 };
+const int       bin_top[PS2SPI_STATS_BINS] = { 0, 1, 3, 7, 15, 31, 63, 64 };
+
+const char     *method_name[] = { "poll", "burst", "adaptive" };
+
+/* ----------------------------------------------------------------------------
+ * main() control functions
+ *
+ */
+int main(int argc, char *argv[])
+{
+    ps2spi_t        dev;
+    result_t        result;
+    read_method_t   method = READ_BURST;
+    const char     *device = DEF_DEVICE;
+    uint32_t        speed = DEF_SPEED;
+    int             gap = DEF_GAP;
+    int             seconds = DEF_SECONDS;
+    int             repeat = -1;
+    int             framed = 0;
+    int             default_rates[] = { 50, 100, 200, 500, 1000 };
+    int             rate_count, i, rate, opt;
+    double          rx_ms, tx_ms, xfer_ms;
+
+    while ( (opt = getopt(argc, argv, "d:s:g:m:t:r:fh")) != -1 )
+    {
+        switch ( opt )
+        {
+            case 'd':
+                device = optarg;
+                break;
+
+            case 's':
+                speed = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'g':
+                gap = atoi(optarg);
+                break;
+
+            case 'm':
+                for ( i = 0; i <= READ_ADAPTIVE; i++ )
+                    if ( strcmp(optarg, method_name[i]) == 0 )
+                        break;
+                if ( i > READ_ADAPTIVE )
+                {
+                    usage();
+                    return 1;
+                }
+                method = (read_method_t) i;
+                break;
+
+            case 't':
+                seconds = atoi(optarg);
+                break;
+
+            case 'r':
+                repeat = strtol(optarg, NULL, 0) & 0xff;
+                break;
+
+            case 'f':
+                framed = 1;
+                break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if ( seconds <= 0 || gap < 0 )
+    {
+        usage();
+        return 1;
+    }
+
+    if ( ps2spi_open(&dev, device, speed, (uint16_t) gap) < 0 )
+    {
+        perror(device);
+        return 1;
+    }
+    dev.framed = framed;
+
+    if ( repeat >= 0 )
+        ps2spi_command_data(&dev, PS2SPI_CMD_REPEAT, (uint8_t) repeat);
+
+    printf("%s, SCLK %u Hz, gap %d uSec, %s reads, %d sec per rate\n",
+           device, speed, gap, method_name[method], seconds);
+    printf("%8s %8s %9s %9s %9s %6s %8s %8s %8s %9s %8s\n",
+           "rate_hz", "codes", "xfer/s", "bytes/s", "read_us", "cpu%",
+           "rx_ms", "tx_ms", "tx_p95", "total_ms", "wake_cy");
+
+    rate_count = ( optind < argc ) ? argc - optind : (int) (sizeof(default_rates) / sizeof(int));
+
+    for ( i = 0; i < rate_count; i++ )
+    {
+        rate = ( optind < argc ) ? atoi(argv[optind + i]) : default_rates[i];
+        if ( rate <= 0 )
+            continue;
+
+        if ( run_rate(&dev, method, rate, seconds, &result) < 0 )
+        {
+            fprintf(stderr, "SPI transfer failed\n");
+            break;
+        }
+
+        rx_ms = hist_mean(result.rx_hist);
+        tx_ms = hist_mean(result.tx_hist);
+        xfer_ms = ( result.reads ) ? result.read_usec / result.reads / 1000.0 : 0;
+
+        printf("%8d %8u %9.1f %9.1f %9.1f %6.2f %8.2f %8.2f %8d %9.2f %8u\n",
+               rate,
+               result.codes,
+               result.transfers / result.wall_sec,
+               result.bytes / result.wall_sec,
+               xfer_ms * 1000.0,
+               100.0 * result.cpu_sec / result.wall_sec,
+               rx_ms,
+               tx_ms,
+               hist_percentile(result.tx_hist, 95),
+               rx_ms + tx_ms + xfer_ms,
+               result.wake_max);
+    }
+
+    if ( repeat >= 0 )
+        ps2spi_command_data(&dev, PS2SPI_CMD_REPEAT, 0);
+    ps2spi_mode(&dev, PS2SPI_MODE_XLATE);
+    ps2spi_close(&dev);
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * usage()
+ *
+ *  Print command line help.
+ *
+ *  param:  none
+ *  return: none
+ */
+void usage(void)
+{
+    fprintf(stderr,
+            "usage: ps2spi_bench [-d device] [-s sclk_hz] [-g gap_us] [-m poll|burst|adaptive]\n"
+            "                    [-t seconds] [-r repeat] [-f] [rate_hz ...]\n"
+            "  -f  SS framed target (ATmega328P)\n"
+            "  -r  AVR generated key repeat byte for the run, hold a key down for a steady load\n");
+}
+
+/* ----------------------------------------------------------------------------
+ * time_sec()
+ *
+ *  Convert a timespec to seconds.
+ *
+ *  param:  time
+ *  return: seconds
+ */
+double time_sec(const struct timespec *t)
+{
+    return t->tv_sec + t->tv_nsec / 1e9;
+}
+
+/* ----------------------------------------------------------------------------
+ * cpu_sec()
+ *
+ *  Process user and system time, including time spent in the spidev driver.
+ *
+ *  param:  none
+ *  return: seconds
+ */
+double cpu_sec(void)
+{
+    struct rusage   usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/* ----------------------------------------------------------------------------
+ * read_codes()
+ *
+ *  Read all pending key codes with one read method.
+ *
+ *  param:  device, read method
+ *  return: key codes read, -1 transfer failed
+ */
+int read_codes(ps2spi_t *dev, read_method_t method)
+{
+    uint8_t     codes[PS2SPI_BLOCK_MAX];
+    int         count, code;
+
+    switch ( method )
+    {
+        case READ_POLL:
+            for ( count = 0; count < POLL_MAX; count++ )
+            {
+                code = ps2spi_poll(dev);
+                if ( code <= 0 )
+                    return ( code < 0 ) ? -1 : count;
+            }
+            return count;
+
+        case READ_BURST:
+            return ps2spi_burst(dev, codes, BURST_EXPECT);
+
+        case READ_ADAPTIVE:
+            return ps2spi_read_adaptive(dev, codes);
+    }
+
+    return -1;
+}
+
+/* ----------------------------------------------------------------------------
+ * read_stats()
+ *
+ *  Read the AVR statistics and keep the two latency histograms and the wake-up cycles.
+ *
+ *  param:  device, result
+ *  return: 0 ok, -1 transfer failed or firmware built without INSTRUMENT
+ */
+int read_stats(ps2spi_t *dev, result_t *result)
+{
+    uint8_t     stats[PS2SPI_BLOCK_MAX];
+    int         i;
+
+    if ( ps2spi_read_block(dev, PS2SPI_CMD_STATS, stats, PS2SPI_STATS_SIZE) != PS2SPI_STATS_SIZE )
+        return -1;
+
+    for ( i = 0; i < PS2SPI_STATS_BINS; i++ )
+    {
+        result->rx_hist[i] = stats[PS2SPI_STATS_RX + 2 * i] | (stats[PS2SPI_STATS_RX + 2 * i + 1] << 8);
+        result->tx_hist[i] = stats[PS2SPI_STATS_TX + 2 * i] | (stats[PS2SPI_STATS_TX + 2 * i + 1] << 8);
+    }
+
+    result->wake_max = stats[PS2SPI_STATS_WAKE];
+    result->wake_avg = stats[PS2SPI_STATS_WAKE + 1];
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * hist_mean()
+ *
+ *  Mean latency of a histogram from its bin mid points. The latencies of
+ *  the two AVR histograms add up, so their means do too.
+ *
+ *  param:  histogram
+ *  return: mean mSec, 0 for an empty histogram
+ */
+double hist_mean(const uint16_t *hist)
+{
+    double      sum = 0;
+    uint32_t    count = 0;
+    int         i;
+
+    for ( i = 0; i < PS2SPI_STATS_BINS; i++ )
+    {
+        sum += hist[i] * bin_mid[i];
+        count += hist[i];
+    }
+
+    return ( count ) ? sum / count : 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * hist_percentile()
+ *
+ *  Upper bound of the bin holding a percentile of a histogram.
+ *
+ *  param:  histogram, percentile
+ *  return: mSec, 64 means 64 or more
+ */
+int hist_percentile(const uint16_t *hist, int percent)
+{
+    uint32_t    count = 0;
+    uint32_t    sum = 0;
+    int         i;
+
+    for ( i = 0; i < PS2SPI_STATS_BINS; i++ )
+        count += hist[i];
+
+    for ( i = 0; i < PS2SPI_STATS_BINS; i++ )
+    {
+        sum += hist[i];
+        if ( sum * 100 >= count * percent )
+            break;
+    }
+
+    return ( i < PS2SPI_STATS_BINS ) ? bin_top[i] : bin_top[PS2SPI_STATS_BINS - 1];
+}
+
+/* ----------------------------------------------------------------------------
+ * run_rate()
+ *
+ *  Read the AVR at a fixed poll rate for 'seconds', on absolute deadlines
+ *  so that the read time does not lower the rate, then read the statistics.
+ *  Statistics and the key code buffer are cleared at the start.
+ *
+ *  param:  device, read method, poll rate Hz, seconds, result
+ *  return: 0 ok, -1 transfer failed
+ */
+int run_rate(ps2spi_t *dev, read_method_t method, int rate, int seconds, result_t *result)
+{
+    struct timespec start, next, before, after;
+    long            period_ns = 1000000000L / rate;
+    double          cpu_start;
+    int             count;
+
+    memset(result, 0, sizeof(result_t));
+
+    if ( ps2spi_mode(dev, ( method == READ_ADAPTIVE ) ? PS2SPI_MODE_DRDY : PS2SPI_MODE_XLATE) < 0 ||
+         ps2spi_command(dev, PS2SPI_CMD_STATCLR) < 0 )
+        return -1;
+
+    dev->transfers = 0;
+    dev->bytes = 0;
+
+    cpu_start = cpu_sec();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+
+    do
+    {
+        next.tv_nsec += period_ns;
+        if ( next.tv_nsec >= 1000000000L )
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        count = read_codes(dev, method);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+
+        if ( count < 0 )
+            return -1;
+
+        result->codes += count;
+        result->reads++;
+        result->read_usec += (time_sec(&after) - time_sec(&before)) * 1e6;
+    }
+    while ( time_sec(&after) - time_sec(&start) < seconds );
+
+    result->wall_sec = time_sec(&after) - time_sec(&start);
+    result->cpu_sec = cpu_sec() - cpu_start;
+    result->transfers = dev->transfers;
+    result->bytes = dev->bytes;
+
+    if ( read_stats(dev, result) < 0 )
+        fprintf(stderr, "no statistics, firmware built without INSTRUMENT?\n");
+
+    return 0;
+}
@@ -0,0 +1,327 @@
+/*
+ * ps2spi_host.c
+ *
+ *  Raspberry Pi spidev client for the ps2spi AVR keyboard interface.
+ *  See ps2spi_host.h and the SPI protocol section of README.md.
+ *
+ */
+
+#include    <stdint.h>
+#include    <string.h>
+#include    <fcntl.h>
+#include    <unistd.h>
+#include    <sys/ioctl.h>
+#include    <linux/spi/spidev.h>
+
+#include    "ps2spi_host.h"
+
+#define     ADAPTIVE_MARGIN     4       // Extra burst bytes for key codes arriving during the transfer
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_open()
+ *
+ *  Open and configure a spidev device, SPI mode 0, MSB first, 8 bit words.
+ *  Any burst left unfinished by a previous client is clocked out, so the
+ *  AVR starts interpreting the next transfer as commands.
+ *
+ *  param:  device state, spidev path, SCLK in Hz, gap after each byte in uSec
+ *  return: 0 ok, -1 open or configuration failed
+ */
+int ps2spi_open(ps2spi_t *dev, const char *path, uint32_t speed_hz, uint16_t gap_us)
+{
+    uint8_t     spi_mode = SPI_MODE_0;
+    uint8_t     bits = 8;
+    uint8_t     tx[PS2SPI_XFER_MAX];
+    uint8_t     rx[PS2SPI_XFER_MAX];
+
+    memset(dev, 0, sizeof(ps2spi_t));
+    dev->speed_hz = speed_hz;
+    dev->gap_us = gap_us;
+
+    dev->fd = open(path, O_RDWR);
+    if ( dev->fd < 0 )
+        return -1;
+
+    if ( ioctl(dev->fd, SPI_IOC_WR_MODE, &spi_mode) < 0 ||
+         ioctl(dev->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+         ioctl(dev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0 )
+    {
+        close(dev->fd);
+        dev->fd = -1;
+        return -1;
+    }
+
+    memset(tx, PS2SPI_CMD_NOP, sizeof(tx));
+    if ( ps2spi_xfer(dev, tx, rx, PS2SPI_XFER_MAX) < 0 )
+    {
+        ps2spi_close(dev);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_close()
+ *
+ *  Close the spidev device.
+ *
+ *  param:  device state
+ *  return: none
+ */
+void ps2spi_close(ps2spi_t *dev)
+{
+    if ( dev->fd >= 0 )
+        close(dev->fd);
+    dev->fd = -1;
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_xfer()
+ *
+ *  Clock 'length' bytes in one SPI_IOC_MESSAGE call, one spi_ioc_transfer
+ *  per byte so that each byte is followed by the AVR's inter-byte gap.
+ *  Chip select stays asserted for the whole message, which frames
+ *  the transaction on targets with a slave select input.
+ *  In data ready mode the first byte received is kept as the link status.
+ *
+ *  param:  device state, bytes to send, received bytes, byte count
+ *  return: 0 ok, -1 ioctl failed or length out of range
+ */
+int ps2spi_xfer(ps2spi_t *dev, const uint8_t *tx, uint8_t *rx, int length)
+{
+    struct spi_ioc_transfer xfer[PS2SPI_XFER_MAX];
+    int     i;
+
+    if ( length < 1 || length > PS2SPI_XFER_MAX )
+        return -1;
+
+    memset(xfer, 0, length * sizeof(struct spi_ioc_transfer));
+
+    for ( i = 0; i < length; i++ )
+    {
+        xfer[i].tx_buf = (unsigned long) &tx[i];
+        xfer[i].rx_buf = (unsigned long) &rx[i];
+        xfer[i].len = 1;
+        xfer[i].speed_hz = dev->speed_hz;
+        xfer[i].delay_usecs = dev->gap_us;
+        xfer[i].bits_per_word = 8;
+    }
+
+    if ( ioctl(dev->fd, SPI_IOC_MESSAGE(length), xfer) < 0 )
+        return -1;
+
+    dev->transfers++;
+    dev->bytes += length;
+
+    if ( dev->mode & PS2SPI_MODE_DRDY )
+        dev->status = rx[0];
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_command()
+ *
+ *  Send a single byte command and return its one byte response,
+ *  for Poll, Status, Flush, Clear stats and Clear errors.
+ *
+ *  param:  device state, command byte
+ *  return: response byte, -1 transfer failed
+ */
+int ps2spi_command(ps2spi_t *dev, uint8_t command)
+{
+    uint8_t     tx[2] = { command, PS2SPI_CMD_NOP };
+    uint8_t     rx[2];
+
+    if ( ps2spi_xfer(dev, tx, rx, 2) < 0 )
+        return -1;
+
+    return rx[1];
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_command_data()
+ *
+ *  Send a command followed by its data byte,
+ *  for Typematic, LEDs, Mode, Repeat and Trace control.
+ *
+ *  param:  device state, command byte, data byte
+ *  return: 0 ok, -1 transfer failed
+ */
+int ps2spi_command_data(ps2spi_t *dev, uint8_t command, uint8_t data)
+{
+    uint8_t     tx[3] = { command, data, PS2SPI_CMD_NOP };
+    uint8_t     rx[3];
+
+    return ps2spi_xfer(dev, tx, rx, 3);
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_mode()
+ *
+ *  Select the output mode, with a flush so that no key code frames
+ *  of the previous mode are read as the new one.
+ *
+ *  param:  device state, PS2SPI_MODE_* output mode and flags
+ *  return: 0 ok, -1 transfer failed
+ */
+int ps2spi_mode(ps2spi_t *dev, uint8_t mode)
+{
+    uint8_t     tx[4] = { PS2SPI_CMD_MODE, mode, PS2SPI_CMD_FLUSH, PS2SPI_CMD_NOP };
+    uint8_t     rx[4];
+
+    dev->mode = mode;
+    dev->status = 0;
+
+    return ps2spi_xfer(dev, tx, rx, 4);
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_poll()
+ *
+ *  Read one key code with the Poll command.
+ *
+ *  param:  device state
+ *  return: key code, 0 none pending, -1 transfer failed
+ */
+int ps2spi_poll(ps2spi_t *dev)
+{
+    return ps2spi_command(dev, PS2SPI_CMD_POLL);
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_read_block()
+ *
+ *  Send a command with a counted response, Burst, Key map, Stats, Errors or Trace,
+ *  and read the count 'n' and the 'n' bytes that follow it.
+ *  The transfer is sized for 'expect' bytes. A longer response is completed
+ *  with a second transfer, since the AVR returns the whole block regardless
+ *  of the bytes the host sends and would otherwise take the next commands as padding.
+ *  On an SS framed target raising SS at the end of the transfer ends the block instead.
+ *  The AVR keeps the Burst key codes and Trace entries that were not clocked out
+ *  for the next read, so only the whole entries read are returned, and other
+ *  blocks are read again sized for 'n'.
+ *
+ *  param:  device state, command byte, buffer of PS2SPI_BLOCK_MAX bytes, expected count
+ *  return: count of bytes in the buffer, 'n' unless an SS framed read was cut short,
+ *          -1 transfer failed
+ */
+int ps2spi_read_block(ps2spi_t *dev, uint8_t command, uint8_t *buffer, int expect)
+{
+    uint8_t     tx[PS2SPI_XFER_MAX];
+    uint8_t     rx[PS2SPI_XFER_MAX];
+    int         length, count, have;
+
+    if ( expect < 0 )
+        expect = 0;
+    if ( expect > PS2SPI_BLOCK_MAX )
+        expect = PS2SPI_BLOCK_MAX;
+
+    // Command, count byte, 'expect' bytes, and the response of the last of them
+    length = expect + 2;
+    memset(tx, PS2SPI_CMD_NOP, length);
+    tx[0] = command;
+
+    if ( ps2spi_xfer(dev, tx, rx, length) < 0 )
+        return -1;
+
+    count = rx[1];
+    have = ( count < expect ) ? count : expect;
+    memcpy(buffer, &rx[2], have);
+
+    // Raising SS ended the block, see above
+    if ( count > expect && dev->framed )
+    {
+        if ( command == PS2SPI_CMD_BURST )
+            return have;
+
+        if ( command == PS2SPI_CMD_TRACE )
+            return have - (have % PS2SPI_TRACE_ENTRY);
+
+        return ps2spi_read_block(dev, command, buffer, count);
+    }
+
+    if ( count > expect )
+    {
+        /* The first byte of this transfer is the response to the last
+         * byte of the previous one, and the last NOP ends the block
+         */
+        length = count - expect;
+        memset(tx, PS2SPI_CMD_NOP, length);
+
+        if ( ps2spi_xfer(dev, tx, rx, length) < 0 )
+            return -1;
+
+        memcpy(&buffer[expect], rx, length);
+    }
+
+    return count;
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_burst()
+ *
+ *  Read all pending key codes with the Burst command.
+ *
+ *  param:  device state, buffer of PS2SPI_BLOCK_MAX bytes, expected key code count
+ *  return: key code count, -1 transfer failed
+ */
+int ps2spi_burst(ps2spi_t *dev, uint8_t *codes, int expect)
+{
+    return ps2spi_read_block(dev, PS2SPI_CMD_BURST, codes, expect);
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_ready()
+ *
+ *  Read the data ready status with a single NOP byte.
+ *  The AVR keeps the status byte in its shift register between transfers,
+ *  so this costs one byte when nothing is pending. Needs PS2SPI_MODE_DRDY.
+ *
+ *  param:  device state
+ *  return: pending key code count, -1 transfer failed
+ */
+int ps2spi_ready(ps2spi_t *dev)
+{
+    uint8_t     tx = PS2SPI_CMD_NOP;
+    uint8_t     rx;
+
+    if ( ps2spi_xfer(dev, &tx, &rx, 1) < 0 )
+        return -1;
+
+    return ( rx & PS2SPI_DRDY_DEPTH );
+}
+
+/* ----------------------------------------------------------------------------
+ * ps2spi_read_adaptive()
+ *
+ *  Read pending key codes in data ready mode, with the burst sized from the
+ *  status byte at the start of the last transfer. When that shows nothing
+ *  pending, or the last transfer was a burst, a one byte status read is made
+ *  first, and the burst only when key codes are pending.
+ *
+ *  param:  device state, buffer of PS2SPI_BLOCK_MAX bytes
+ *  return: key code count, -1 transfer failed
+ */
+int ps2spi_read_adaptive(ps2spi_t *dev, uint8_t *codes)
+{
+    int     pending;
+
+    pending = dev->status & PS2SPI_DRDY_DEPTH;
+
+    if ( pending == 0 )
+    {
+        pending = ps2spi_ready(dev);
+        if ( pending <= 0 )
+            return pending;
+    }
+
+    /* The status at the start of the burst counted the key codes it removes,
+     * so the next read starts with a status read
+     */
+    pending = ps2spi_burst(dev, codes, pending + ADAPTIVE_MARGIN);
+    dev->status = 0;
+
+    return pending;
+}
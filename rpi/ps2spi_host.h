@@ -0,0 +1,99 @@
+/*
+ * ps2spi_host.h
+ *
+ *  Raspberry Pi host side of the ps2spi SPI protocol.
+ *  Reads key codes, status, statistics and trace entries from the AVR through spidev.
+ *
+ *  The AVR loads each response byte after the byte that requested it, so
+ *  the response to the last byte of a transfer is the first byte of the next one.
+ *  Every transfer built here therefore ends with a NOP command, which keeps the first
+ *  byte of the next transfer at 0, or at the status byte with PS2SPI_MODE_DRDY.
+ *
+ *  Each byte is a separate spi_ioc_transfer with 'delay_usecs' set to the
+ *  inter-byte gap, and a whole transfer is sent with one SPI_IOC_MESSAGE ioctl.
+ *
+ */
+
+#ifndef __PS2SPI_HOST_H__
+#define __PS2SPI_HOST_H__
+
+#include    <stdint.h>
+
+// SPI commands
+#define     PS2SPI_CMD_POLL     0x00    // Next key code, 0 if none
+#define     PS2SPI_CMD_BURST    0x01    // FIFO depth 'n' followed by 'n' key codes
+#define     PS2SPI_CMD_STATUS   0x02    // PS2SPI_STAT_* flags, cleared when read
+#define     PS2SPI_CMD_KEYMAP   0x03    // Size 'n' followed by 'n' bytes of pressed-key bitmap
+#define     PS2SPI_CMD_TYPEMAT  0x10    // Typematic rate/delay, next byte
+#define     PS2SPI_CMD_LEDS     0x11    // Lock LEDs, next byte
+#define     PS2SPI_CMD_FLUSH    0x12    // Discard all buffered scan codes and key codes
+#define     PS2SPI_CMD_MODE     0x13    // Output mode, next byte PS2SPI_MODE_*
+#define     PS2SPI_CMD_REPEAT   0x14    // AVR generated key repeat, next byte
+#define     PS2SPI_CMD_STATS    0x20    // Size 'n' followed by 'n' bytes of statistics
+#define     PS2SPI_CMD_STATCLR  0x21    // Clear statistics
+#define     PS2SPI_CMD_ERRORS   0x22    // Size 'n' followed by 'n' bytes of error counters
+#define     PS2SPI_CMD_ERRCLR   0x23    // Clear error counters
+#define     PS2SPI_CMD_TRACE    0x24    // Byte count 'n' followed by 'n' bytes of trace entries
+#define     PS2SPI_CMD_TRCCTL   0x25    // Trace capture control, next byte
+#define     PS2SPI_CMD_NOP      0xff    // No key code removed
+
+// Output modes and flags
+#define     PS2SPI_MODE_XLATE   0x00    // Filtered and translated key codes for the Dragon
+#define     PS2SPI_MODE_RAW     0x01    // Unfiltered scan codes
+#define     PS2SPI_MODE_DRAGON  0x02    // Dragon 32 and Dragon 64 keyboard matrix codes
+#define     PS2SPI_MODE_COCO    0x03    // Tandy CoCo keyboard matrix codes
+#define     PS2SPI_MODE_SEQ     0x08    // Key code frames end with a sequence byte
+#define     PS2SPI_MODE_DRDY    0x10    // Idle response is a status byte
+#define     PS2SPI_MODE_TIME    0x20    // Key codes are followed by a time delta byte
+#define     PS2SPI_MODE_KEYUP   0x40    // All keys up marker after a lost break code
+#define     PS2SPI_MODE_NOREP   0x80    // Drop keyboard typematic repeats
+
+// Data ready status byte
+#define     PS2SPI_DRDY_PEND    0x80    // Key codes pending
+#define     PS2SPI_DRDY_DEPTH   0x7f    // Key codes pending count
+
+// Status command flags
+#define     PS2SPI_STAT_OVRFL   0x01    // Key code buffer overflowed
+#define     PS2SPI_STAT_SET2    0x02    // Keyboard is in scan code set 2
+#define     PS2SPI_STAT_TROVF   0x04    // Trace entries dropped
+#define     PS2SPI_STAT_WDRST   0x08    // AVR restarted by the watchdog
+
+// Statistics layout of an INSTRUMENT build
+#define     PS2SPI_STATS_SIZE   40      // Stats command size 'n'
+#define     PS2SPI_STATS_BINS   8       // Latency histogram bins, 0, 1, 2-3, ... 64+ mSec
+#define     PS2SPI_STATS_RX     6       // Offset of stop bit to key code buffer histogram
+#define     PS2SPI_STATS_TX     22      // Offset of key code buffer to SPI read histogram
+#define     PS2SPI_STATS_WAKE   38      // Offset of idle sleep wake-up cycles, maximum and average
+
+#define     PS2SPI_TRACE_ENTRY  3       // Bytes per trace entry, type, data and tick
+
+#define     PS2SPI_BLOCK_MAX    255     // Largest count 'n' of a counted response
+#define     PS2SPI_XFER_MAX     (PS2SPI_BLOCK_MAX + 2)  // Bytes per transfer, command, count and block
+
+typedef struct
+{
+    int      fd;            // spidev file descriptor
+    uint32_t speed_hz;      // SCLK
+    uint16_t gap_us;        // Delay after each byte
+    uint8_t  framed;        // 1 for a target with SS framed transactions (ATmega328P)
+    uint8_t  mode;          // Output mode last set with ps2spi_mode()
+    uint8_t  status;        // Data ready status byte from the start of the last transfer
+    uint32_t transfers;     // SPI_IOC_MESSAGE calls
+    uint32_t bytes;         // Bytes clocked
+} ps2spi_t;
+
+int     ps2spi_open(ps2spi_t *dev, const char *path, uint32_t speed_hz, uint16_t gap_us);
+void    ps2spi_close(ps2spi_t *dev);
+int     ps2spi_xfer(ps2spi_t *dev, const uint8_t *tx, uint8_t *rx, int length);
+
+int     ps2spi_command(ps2spi_t *dev, uint8_t command);
+int     ps2spi_command_data(ps2spi_t *dev, uint8_t command, uint8_t data);
+int     ps2spi_mode(ps2spi_t *dev, uint8_t mode);
+
+int     ps2spi_poll(ps2spi_t *dev);
+int     ps2spi_read_block(ps2spi_t *dev, uint8_t command, uint8_t *buffer, int expect);
+int     ps2spi_burst(ps2spi_t *dev, uint8_t *codes, int expect);
+int     ps2spi_ready(ps2spi_t *dev);
+int     ps2spi_read_adaptive(ps2spi_t *dev, uint8_t *codes);
+
+#endif  /* __PS2SPI_HOST_H__ */